@@ -0,0 +1,244 @@
+#pragma once
+
+#include <math.h>
+#include <vector>
+#include "Resources.h"
+#include "Pipelines.h"
+#include "Permutations.h"
+
+//Clustered forward lighting
+//View frustum is split into a froxel grid, screen tiles times exponential depth slices.
+//A first compute pass frustum culls the lights and buckets them by depth slice, a second one tests each cluster
+//against the lights of its slice and writes a compact list of light indices per cluster,
+//the fragment shader finds its cluster from pixel position and view depth and only loops over that list.
+//Lights and the scene are in view space, the grid follows the projection and is rewritten every frame so resizes pick it up.
+
+constexpr uint32_t clusterTilesX = 16;
+constexpr uint32_t clusterTilesY = 9;
+constexpr uint32_t clusterSlices = 24;
+constexpr uint32_t clusterCount = clusterTilesX * clusterTilesY * clusterSlices;
+
+//Matches lightbin.comp.glsl, lights past this in one cluster are dropped and counted in LightStats
+constexpr uint32_t maxLightsPerCluster = 256;
+//Average list length the index buffer is sized for, clusters that do not fit get truncated lists and are counted too
+constexpr uint32_t averageLightsPerCluster = 128;
+
+//Matches specialization constants in lightbin.comp.glsl
+struct LightSliceCull : SpecFeature<0> {};
+struct LightBinShader : ShaderFeatures<ShaderLightBin, LightSliceCull> {};
+
+//Matches LightCounters in lightbin.comp.glsl, cleared every frame
+struct LightCounters
+{
+    uint32_t indexCount; //Allocator for lightIndices, can end past the capacity
+    uint32_t droppedLightCount;
+    uint32_t truncatedClusterCount;
+    uint32_t sliceLightCounts[clusterSlices];
+};
+
+//Counters copied back for the CPU, the leading part of LightCounters
+struct LightStats
+{
+    uint32_t indexCount; //Indices the clusters asked for
+    uint32_t droppedLightCount;
+    uint32_t truncatedClusterCount;
+};
+
+//Matches Light in lightbin.comp.glsl and triangle.frag.glsl
+struct Light
+{
+    float position[3]; //View space
+    float radius;      //Light has no effect past this
+    float color[3];
+    float spotCosOuter; //Cosine of the cone half angle, -2 for point lights
+    float direction[3]; //Spot direction in view space
+    float spotCosInner; //Full intensity inside this cone
+};
+
+//Matches ClusterGrid uniform block, std140
+struct ClusterGrid
+{
+    float P00, P11;
+    float znear;
+    float zfar;      //Last slice ends here, farther fragments use the last slice
+    uint32_t tilesX, tilesY, slices;
+    uint32_t lightCount;
+    float tileWidth, tileHeight; //Pixels
+    float sliceScale, sliceBias; //slice = log(z) * sliceScale + sliceBias
+};
+
+struct ClusteredLighting
+{
+    uint32_t lightCount = 0;
+
+    Buffer grid;         //ClusterGrid, updated in the command buffer every frame
+    Buffer lights;       //lightCount Light
+    Buffer clusters;     //clusterCount uvec2 offset, count into lightIndices
+    Buffer lightIndices; //clusterCount * averageLightsPerCluster uint
+    Buffer counters;     //LightCounters
+    Buffer sliceLights;  //clusterSlices * lightCount uint, lights the slice cull kept for each slice
+    std::vector<Buffer> readback; //LightStats per frame in flight, host visible
+
+    VkUnique<VkDescriptorPool> descriptorPool;
+    VkUnique<VkDescriptorSetLayout> binSetLayout;
+    VkUnique<VkPipelineLayout> binLayout;
+    VkPipeline sliceCullPipeline = VK_NULL_HANDLE; //Owned by the PermutationCache
+    VkPipeline binPipeline = VK_NULL_HANDLE;
+    VkDescriptorSet binSet = VK_NULL_HANDLE;
+};
+
+inline ClusterGrid createClusterGrid(float P00, float P11, float znear, float zfar, uint32_t viewWidth, uint32_t viewHeight, uint32_t lightCount)
+{
+    ClusterGrid grid = {};
+    grid.P00 = P00;
+    grid.P11 = P11;
+    grid.znear = znear;
+    grid.zfar = zfar;
+    grid.tilesX = clusterTilesX;
+    grid.tilesY = clusterTilesY;
+    grid.slices = clusterSlices;
+    grid.lightCount = lightCount;
+    grid.tileWidth = float(viewWidth) / float(clusterTilesX);
+    grid.tileHeight = float(viewHeight) / float(clusterTilesY);
+
+    //Exponential slices keep clusters roughly cube shaped, slice s starts at znear * (zfar / znear)^(s / slices)
+    float logRange = logf(zfar / znear);
+    grid.sliceScale = float(clusterSlices) / logRange;
+    grid.sliceBias = -float(clusterSlices) * logf(znear) / logRange;
+
+    return grid;
+}
+
+inline void createClusteredLighting(ClusteredLighting& lighting, VkDevice device, const VkPhysicalDeviceMemoryProperties& memoryProperties,
+                                    const std::vector<Light>& lights, uint32_t framesInFlight, UploadBatch& uploads, VkShaderModule binShader,
+                                    PermutationCache& pipelines)
+{
+    assert(!lights.empty());
+
+    lighting.lightCount = static_cast<uint32_t>(lights.size());
+
+    lighting.grid = createBuffer(device, memoryProperties, sizeof(ClusterGrid), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    lighting.lights = createBuffer(device, memoryProperties, lights.size() * sizeof(Light), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                   VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    uploadBuffer(device, memoryProperties, uploads, lighting.lights, lights.data(), lighting.lights.size);
+
+    lighting.clusters = createBuffer(device, memoryProperties, clusterCount * 2 * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    lighting.lightIndices = createBuffer(device, memoryProperties, clusterCount * averageLightsPerCluster * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    lighting.counters = createBuffer(device, memoryProperties, sizeof(LightCounters),
+                                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    lighting.sliceLights = createBuffer(device, memoryProperties, clusterSlices * lights.size() * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    //Zeroed so slots read before their first frame retires report nothing dropped
+    lighting.readback.resize(framesInFlight);
+    for (auto& buffer : lighting.readback)
+    {
+        buffer = createBuffer(device, memoryProperties, sizeof(LightStats), VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        memset(buffer.data, 0, sizeof(LightStats));
+    }
+
+    VkDescriptorSetLayoutBinding binBindings[] =
+    {
+        { 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0 },
+        { 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0 },
+        { 2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0 },
+        { 3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0 },
+        { 4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0 },
+        { 5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0 },
+    };
+
+    lighting.descriptorPool = makeUnique(device, createDescriptorPool(device, 1), vkDestroyDescriptorPool);
+    lighting.binSetLayout = makeUnique(device, createDescriptorSetLayout(device, binBindings, sizeof(binBindings) / sizeof(binBindings[0])), vkDestroyDescriptorSetLayout);
+    lighting.binLayout = makeUnique(device, createPipelineLayout(device, lighting.binSetLayout, 0, 0), vkDestroyPipelineLayout);
+
+    VkPipelineLayout binLayout = lighting.binLayout;
+    auto createBin = [device, binShader, binLayout](const VkSpecializationInfo* specializationInfo)
+    {
+        return createComputePipeline(device, binShader, binLayout, specializationInfo);
+    };
+
+    lighting.sliceCullPipeline = pipelines.get<LightBinShader, FeatureSet<LightSliceCull>>(device, createBin);
+    lighting.binPipeline = pipelines.get<LightBinShader, FeatureSet<>>(device, createBin);
+
+    lighting.binSet = allocateDescriptorSet(device, lighting.descriptorPool, lighting.binSetLayout);
+    writeBufferDescriptor(device, lighting.binSet, 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, lighting.grid.buffer);
+    writeBufferDescriptor(device, lighting.binSet, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, lighting.lights.buffer);
+    writeBufferDescriptor(device, lighting.binSet, 2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, lighting.clusters.buffer);
+    writeBufferDescriptor(device, lighting.binSet, 3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, lighting.lightIndices.buffer);
+    writeBufferDescriptor(device, lighting.binSet, 4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, lighting.counters.buffer);
+    writeBufferDescriptor(device, lighting.binSet, 5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, lighting.sliceLights.buffer);
+}
+
+//Rebuilds the cluster lists for grid, must be recorded outside of a render pass before anything shades with them
+//Grid goes through the command buffer, a host write could change it under the frame still in flight
+inline void recordLightBinning(VkCommandBuffer cmdBuffer, const ClusteredLighting& lighting, const ClusterGrid& grid)
+{
+    //Previous frame's fragments may still read the lists we are about to rewrite
+    VkMemoryBarrier readBarrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    readBarrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT;
+    readBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &readBarrier, 0, 0, 0, 0);
+
+    vkCmdUpdateBuffer(cmdBuffer, lighting.grid.buffer, 0, sizeof(grid), &grid);
+    vkCmdFillBuffer(cmdBuffer, lighting.counters.buffer, 0, sizeof(LightCounters), 0);
+
+    VkBufferMemoryBarrier fillBarriers[] =
+    {
+        bufferBarrier(lighting.grid.buffer, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_UNIFORM_READ_BIT),
+        bufferBarrier(lighting.counters.buffer, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT),
+    };
+
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, 0,
+                         sizeof(fillBarriers) / sizeof(fillBarriers[0]), fillBarriers, 0, 0);
+
+    vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, lighting.binLayout, 0, 1, &lighting.binSet, 0, 0);
+
+    //One thread per light, each cluster then only tests the lights of its slice instead of all of them
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, lighting.sliceCullPipeline);
+    vkCmdDispatch(cmdBuffer, getGroupCount(lighting.lightCount, 64), 1, 1);
+
+    VkMemoryBarrier sliceBarrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    sliceBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    sliceBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &sliceBarrier, 0, 0, 0, 0);
+
+    //One workgroup per cluster
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, lighting.binPipeline);
+    vkCmdDispatch(cmdBuffer, clusterTilesX, clusterTilesY, clusterSlices);
+
+    VkMemoryBarrier binBarrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    binBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    binBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 1, &binBarrier, 0, 0, 0, 0);
+}
+
+//Copies the overflow counters of this frame to its readback slot, meant for a command buffer of the SubmitReadback stage
+inline void recordLightReadback(VkCommandBuffer cmdBuffer, const ClusteredLighting& lighting, uint32_t frameIndex)
+{
+    VkBufferMemoryBarrier copyBarrier = bufferBarrier(lighting.counters.buffer, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, 0, 1, &copyBarrier, 0, 0);
+
+    VkBufferCopy region = { 0, 0, sizeof(LightStats) };
+    vkCmdCopyBuffer(cmdBuffer, lighting.counters.buffer, lighting.readback[frameIndex].buffer, 1, &region);
+
+    VkBufferMemoryBarrier hostBarrier = bufferBarrier(lighting.readback[frameIndex].buffer, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT);
+
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, 0, 1, &hostBarrier, 0, 0);
+}
+
+//Call after waiting on the fence of frameIndex, returns counters recorded the last time this slot was used
+inline LightStats readLightStats(const ClusteredLighting& lighting, uint32_t frameIndex)
+{
+    LightStats stats;
+    memcpy(&stats, lighting.readback[frameIndex].data, sizeof(stats));
+
+    return stats;
+}
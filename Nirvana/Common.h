@@ -0,0 +1,12 @@
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+#include <vulkan/vulkan.h>
+
+#define VK_CHECK(call) \
+do {\
+ VkResult result = call; \
+assert(result == VK_SUCCESS); \
+} while(0);\
+
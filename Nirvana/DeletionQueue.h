@@ -0,0 +1,68 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include "Handles.h"
+
+//Resources released while the GPU may still be reading them are parked here with the frame number
+//(or timeline semaphore value) of the last submission that used them. They are destroyed once that
+//value has retired, so streaming/resize/reload never has to drain the device with vkDeviceWaitIdle.
+class DeletionQueue
+{
+public:
+    void push(uint64_t retireValue, std::function<void()> destroy)
+    {
+        //Values come from a monotonic frame counter/timeline so the queue stays sorted
+        assert(entries.empty() || entries.back().retireValue <= retireValue);
+
+        entries.push_back({ retireValue, std::move(destroy) });
+    }
+
+    template<typename T>
+    void push(uint64_t retireValue, VkUnique<T>&& object)
+    {
+        VkDevice device = object.getDevice();
+        typename VkUnique<T>::PFN_destroy destroy = object.getDestroy();
+        T handle = object.release();
+
+        if (handle != VK_NULL_HANDLE)
+        {
+            push(retireValue, [device, handle, destroy]() { destroy(device, handle, 0); });
+        }
+    }
+
+    //Destroys everything whose last use is at or before completedValue
+    void collect(uint64_t completedValue)
+    {
+        while (!entries.empty() && entries.front().retireValue <= completedValue)
+        {
+            entries.front().destroy();
+            entries.pop_front();
+        }
+    }
+
+    //Only valid once the device is idle e.g at shutdown
+    void flush()
+    {
+        for (auto& entry : entries)
+        {
+            entry.destroy();
+        }
+
+        entries.clear();
+    }
+
+    size_t size() const
+    {
+        return entries.size();
+    }
+
+private:
+    struct Entry
+    {
+        uint64_t retireValue;
+        std::function<void()> destroy;
+    };
+
+    std::deque<Entry> entries;
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "Common.h"
+
+//Owns a device level Vulkan object and destroys it when it goes out of scope.
+//Every vkDestroyXXX(device, handle, allocator) entry point (and vkFreeMemory) has the same shape
+//so we store the destroy function with the handle instead of writing one wrapper per type.
+template<typename T>
+class VkUnique
+{
+public:
+    typedef void (VKAPI_PTR *PFN_destroy)(VkDevice device, T handle, const VkAllocationCallbacks* pAllocator);
+
+    VkUnique() = default;
+
+    VkUnique(VkDevice device, T handle, PFN_destroy destroy)
+        : device(device), handle(handle), destroy(destroy)
+    {
+    }
+
+    ~VkUnique()
+    {
+        reset();
+    }
+
+    VkUnique(const VkUnique&) = delete;
+    VkUnique& operator=(const VkUnique&) = delete;
+
+    VkUnique(VkUnique&& other) noexcept
+        : device(other.device), handle(other.handle), destroy(other.destroy)
+    {
+        other.handle = VK_NULL_HANDLE;
+    }
+
+    VkUnique& operator=(VkUnique&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            device = other.device;
+            handle = other.handle;
+            destroy = other.destroy;
+            other.handle = VK_NULL_HANDLE;
+        }
+
+        return *this;
+    }
+
+    //Implicit conversion keeps it drop-in for code that takes raw handles
+    operator T() const { return handle; }
+
+    T get() const { return handle; }
+    const T* address() const { return &handle; }
+    VkDevice getDevice() const { return device; }
+    PFN_destroy getDestroy() const { return destroy; }
+
+    //Gives up ownership without destroying, caller is now responsible for the handle
+    T release()
+    {
+        T released = handle;
+        handle = VK_NULL_HANDLE;
+        return released;
+    }
+
+    void reset()
+    {
+        if (handle != VK_NULL_HANDLE)
+        {
+            destroy(device, handle, 0);
+            handle = VK_NULL_HANDLE;
+        }
+    }
+
+private:
+    VkDevice device = VK_NULL_HANDLE;
+    T handle = VK_NULL_HANDLE;
+    PFN_destroy destroy = nullptr;
+};
+
+template<typename T>
+VkUnique<T> makeUnique(VkDevice device, T handle, typename VkUnique<T>::PFN_destroy destroy)
+{
+    return VkUnique<T>(device, handle, destroy);
+}
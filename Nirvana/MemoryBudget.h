@@ -0,0 +1,438 @@
+#pragma once
+
+#include <stdio.h>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Handles.h"
+
+//Device memory accounting. Every vkAllocateMemory of the renderer goes through allocateTrackedMemory and every
+//free through freeTrackedMemory, so usage per heap and per category is exact for our own allocations.
+//With VK_EXT_memory_budget the driver also reports what the whole process uses and how much it may use,
+//without it the budget is estimated as a fraction of the heap size.
+//Streaming systems register eviction handlers that are asked to release memory once a heap gets close to its budget.
+//Memory they release usually waits in a DeletionQueue until the GPU is done with it, trackPendingFree marks it so
+//the next update does not ask for the same bytes again while the driver still counts them.
+//Eviction is not permanent, owners bring memory back once hasHeadroom says it fits under the eviction target again.
+
+enum MemoryCategory : uint32_t
+{
+    MemoryBuffer,     //Device buffers : geometry, indirect, storage
+    MemoryTexture,    //Sampled only images
+    MemoryAttachment, //Images the GPU renders or writes to : depth, color, storage images
+    MemoryStaging,    //Host visible transfer sources
+
+    MemoryCategoryCount
+};
+
+inline const char* getMemoryCategoryName(MemoryCategory category)
+{
+    static const char* names[MemoryCategoryCount] = { "buffers", "textures", "attachments", "staging" };
+
+    return names[category];
+}
+
+struct MemoryUsage
+{
+    VkDeviceSize bytes = 0;
+    VkDeviceSize peakBytes = 0; //High-water mark since startup
+    uint32_t allocationCount = 0;
+};
+
+struct HeapBudget
+{
+    VkDeviceSize size = 0;
+    bool deviceLocal = false;
+
+    MemoryUsage tracked;                      //Our allocations
+    MemoryUsage categories[MemoryCategoryCount];
+
+    VkDeviceSize driverUsage = 0;  //Whole process as the driver sees it, equals tracked.bytes without the extension
+    VkDeviceSize budget = 0;       //What we may use before allocations start failing or paging
+    VkDeviceSize peakDriverUsage = 0;
+
+    VkDeviceSize pendingFree = 0;  //Released, waiting for the frames that use it to retire
+    bool overBudget = false;       //Still over the threshold after eviction, nothing left to release
+};
+
+//Heap is over budget once usage crosses evictionThreshold, handlers are asked to bring it down to evictionTarget
+constexpr float memoryEvictionThreshold = 0.9f;
+constexpr float memoryEvictionTarget = 0.8f;
+
+//Without VK_EXT_memory_budget, share of a heap we assume is ours, the rest goes to other processes and the OS
+constexpr float memoryEstimatedBudget = 0.8f;
+
+//Called with the heap and the number of bytes to release, returns the bytes it actually released
+typedef std::function<VkDeviceSize(uint32_t heapIndex, VkDeviceSize bytesToFree)> EvictionHandler;
+
+class MemoryTracker
+{
+public:
+    void init(VkPhysicalDevice device, bool memoryBudgetSupported)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        physicalDevice = device;
+        budgetSupported = memoryBudgetSupported;
+
+        vkGetPhysicalDeviceMemoryProperties(device, &memoryProperties);
+
+        heaps.assign(memoryProperties.memoryHeapCount, HeapBudget());
+        for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; i++)
+        {
+            heaps[i].size = memoryProperties.memoryHeaps[i].size;
+            heaps[i].deviceLocal = (memoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) != 0;
+        }
+
+        updateBudgetLocked();
+    }
+
+    void trackAllocation(VkDeviceMemory memory, uint32_t memoryTypeIndex, VkDeviceSize size, MemoryCategory category)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        assert(memoryTypeIndex < memoryProperties.memoryTypeCount);
+        uint32_t heapIndex = memoryProperties.memoryTypes[memoryTypeIndex].heapIndex;
+
+        allocations[memory] = { heapIndex, category, size, false };
+
+        HeapBudget& heap = heaps[heapIndex];
+        addUsage(heap.tracked, size);
+        addUsage(heap.categories[category], size);
+        addUsage(totals[category], size);
+    }
+
+    void trackFree(VkDeviceMemory memory)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto it = allocations.find(memory);
+        assert(it != allocations.end());
+
+        const Allocation& allocation = it->second;
+        HeapBudget& heap = heaps[allocation.heapIndex];
+
+        if (allocation.pendingFree)
+        {
+            assert(heap.pendingFree >= allocation.size);
+            heap.pendingFree -= allocation.size;
+        }
+
+        removeUsage(heap.tracked, allocation.size);
+        removeUsage(heap.categories[allocation.category], allocation.size);
+        removeUsage(totals[allocation.category], allocation.size);
+
+        allocations.erase(it);
+    }
+
+    //Memory is released but the GPU may still use it, eviction treats it as gone
+    void trackPendingFree(VkDeviceMemory memory)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto it = allocations.find(memory);
+        assert(it != allocations.end());
+
+        Allocation& allocation = it->second;
+
+        if (!allocation.pendingFree)
+        {
+            allocation.pendingFree = true;
+            heaps[allocation.heapIndex].pendingFree += allocation.size;
+        }
+    }
+
+    //Lets owners of memory find out which heap an eviction request is about
+    bool getAllocation(VkDeviceMemory memory, uint32_t& outHeapIndex, VkDeviceSize& outSize) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto it = allocations.find(memory);
+
+        if (it == allocations.end())
+        {
+            return false;
+        }
+
+        outHeapIndex = it->second.heapIndex;
+        outSize = it->second.size;
+
+        return true;
+    }
+
+    //True if size more bytes keep the heap under the eviction target, so restored memory is not evicted again right away
+    bool hasHeadroom(uint32_t heapIndex, VkDeviceSize size) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        const HeapBudget& heap = heaps[heapIndex];
+
+        return heap.budget != 0 && getUsage(heap) + size <= VkDeviceSize(heap.budget * memoryEvictionTarget);
+    }
+
+    //Refreshes driver numbers and runs eviction, once per frame is enough, the query is not free.
+    //Heaps that stay over the threshold with nothing left to evict are flagged overBudget in getHeaps.
+    void update()
+    {
+        std::vector<std::pair<uint32_t, VkDeviceSize>> overBudget;
+        std::vector<EvictionHandler> handlers;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            updateBudgetLocked();
+
+            for (uint32_t i = 0; i < heaps.size(); i++)
+            {
+                HeapBudget& heap = heaps[i];
+                VkDeviceSize usage = getUsage(heap);
+
+                if (heap.budget != 0 && usage > VkDeviceSize(heap.budget * memoryEvictionThreshold))
+                {
+                    overBudget.push_back({ i, usage - VkDeviceSize(heap.budget * memoryEvictionTarget) });
+                }
+                else
+                {
+                    heap.overBudget = false;
+                }
+            }
+
+            if (!overBudget.empty())
+            {
+                handlers = evictionHandlers;
+            }
+        }
+
+        //Handlers free memory which comes back into the tracker, so they run without the lock on a copy of the list
+        for (const auto& heap : overBudget)
+        {
+            VkDeviceSize remaining = heap.second;
+
+            for (const auto& handler : handlers)
+            {
+                if (remaining == 0)
+                {
+                    break;
+                }
+
+                VkDeviceSize freed = handler(heap.first, remaining);
+                remaining = freed < remaining ? remaining - freed : 0;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            heaps[heap.first].overBudget = remaining != 0;
+        }
+    }
+
+    void addEvictionHandler(EvictionHandler handler)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        evictionHandlers.push_back(std::move(handler));
+    }
+
+    //Handlers usually capture the renderer, drop them before it goes away
+    void clearEvictionHandlers()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        evictionHandlers.clear();
+    }
+
+    //Copies so the numbers stay consistent while other threads allocate
+    std::vector<HeapBudget> getHeaps() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return heaps;
+    }
+
+    MemoryUsage getCategory(MemoryCategory category) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return totals[category];
+    }
+
+    bool isBudgetSupported() const
+    {
+        return budgetSupported;
+    }
+
+    std::string toJson() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        std::string json = "{\n";
+        appendFormat(json, "  \"memoryBudgetExtension\": %s,\n", budgetSupported ? "true" : "false");
+
+        json += "  \"categories\": {\n";
+        for (uint32_t c = 0; c < MemoryCategoryCount; c++)
+        {
+            appendFormat(json, "    \"%s\": ", getMemoryCategoryName(MemoryCategory(c)));
+            appendUsage(json, totals[c]);
+            json += c + 1 < MemoryCategoryCount ? ",\n" : "\n";
+        }
+        json += "  },\n";
+
+        json += "  \"heaps\": [\n";
+        for (size_t i = 0; i < heaps.size(); i++)
+        {
+            const HeapBudget& heap = heaps[i];
+
+            json += "    {\n";
+            appendFormat(json, "      \"index\": %zu,\n", i);
+            appendFormat(json, "      \"deviceLocal\": %s,\n", heap.deviceLocal ? "true" : "false");
+            appendFormat(json, "      \"size\": %llu,\n", static_cast<unsigned long long>(heap.size));
+            appendFormat(json, "      \"budget\": %llu,\n", static_cast<unsigned long long>(heap.budget));
+            appendFormat(json, "      \"driverUsage\": %llu,\n", static_cast<unsigned long long>(heap.driverUsage));
+            appendFormat(json, "      \"peakDriverUsage\": %llu,\n", static_cast<unsigned long long>(heap.peakDriverUsage));
+            json += "      \"tracked\": ";
+            appendUsage(json, heap.tracked);
+            json += ",\n      \"categories\": {\n";
+            for (uint32_t c = 0; c < MemoryCategoryCount; c++)
+            {
+                appendFormat(json, "        \"%s\": ", getMemoryCategoryName(MemoryCategory(c)));
+                appendUsage(json, heap.categories[c]);
+                json += c + 1 < MemoryCategoryCount ? ",\n" : "\n";
+            }
+            json += "      }\n";
+            json += i + 1 < heaps.size() ? "    },\n" : "    }\n";
+        }
+        json += "  ]\n}\n";
+
+        return json;
+    }
+
+    bool writeJson(const char* path) const
+    {
+        FILE* file = fopen(path, "w");
+
+        if (!file)
+        {
+            return false;
+        }
+
+        std::string json = toJson();
+        bool ok = fwrite(json.data(), 1, json.size(), file) == json.size();
+        fclose(file);
+
+        return ok;
+    }
+
+private:
+    struct Allocation
+    {
+        uint32_t heapIndex;
+        MemoryCategory category;
+        VkDeviceSize size;
+        bool pendingFree;
+    };
+
+    //Driver keeps counting deferred frees until their frame retires, they are already on their way out
+    static VkDeviceSize getUsage(const HeapBudget& heap)
+    {
+        return heap.driverUsage - std::min(heap.pendingFree, heap.driverUsage);
+    }
+
+    static void addUsage(MemoryUsage& usage, VkDeviceSize size)
+    {
+        usage.bytes += size;
+        usage.allocationCount++;
+        usage.peakBytes = std::max(usage.peakBytes, usage.bytes);
+    }
+
+    static void removeUsage(MemoryUsage& usage, VkDeviceSize size)
+    {
+        assert(usage.bytes >= size && usage.allocationCount > 0);
+
+        usage.bytes -= size;
+        usage.allocationCount--;
+    }
+
+    template<typename... Args>
+    static void appendFormat(std::string& out, const char* format, Args... args)
+    {
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer), format, args...);
+        out += buffer;
+    }
+
+    static void appendUsage(std::string& out, const MemoryUsage& usage)
+    {
+        appendFormat(out, "{ \"bytes\": %llu, \"peakBytes\": %llu, \"allocations\": %u }",
+                     static_cast<unsigned long long>(usage.bytes), static_cast<unsigned long long>(usage.peakBytes), usage.allocationCount);
+    }
+
+    void updateBudgetLocked()
+    {
+        if (budgetSupported)
+        {
+            VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProperties = {};
+            budgetProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+
+            VkPhysicalDeviceMemoryProperties2 properties = {};
+            properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+            properties.pNext = &budgetProperties;
+
+            vkGetPhysicalDeviceMemoryProperties2(physicalDevice, &properties);
+
+            for (uint32_t i = 0; i < heaps.size(); i++)
+            {
+                heaps[i].driverUsage = budgetProperties.heapUsage[i];
+                heaps[i].budget = budgetProperties.heapBudget[i];
+            }
+        }
+        else
+        {
+            for (HeapBudget& heap : heaps)
+            {
+                heap.driverUsage = heap.tracked.bytes;
+                heap.budget = VkDeviceSize(heap.size * memoryEstimatedBudget);
+            }
+        }
+
+        for (HeapBudget& heap : heaps)
+        {
+            heap.peakDriverUsage = std::max(heap.peakDriverUsage, heap.driverUsage);
+        }
+    }
+
+    mutable std::mutex mutex;
+
+    VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+    VkPhysicalDeviceMemoryProperties memoryProperties = {};
+    bool budgetSupported = false;
+
+    std::vector<HeapBudget> heaps;
+    MemoryUsage totals[MemoryCategoryCount];
+    std::unordered_map<VkDeviceMemory, Allocation> allocations;
+
+    std::vector<EvictionHandler> evictionHandlers;
+};
+
+//One device, one tracker. Global because memory is freed through VkUnique destroy function pointers which carry no context.
+inline MemoryTracker& getMemoryTracker()
+{
+    static MemoryTracker tracker;
+    return tracker;
+}
+
+inline VKAPI_ATTR void VKAPI_CALL freeTrackedMemory(VkDevice device, VkDeviceMemory memory, const VkAllocationCallbacks* allocator)
+{
+    getMemoryTracker().trackFree(memory);
+    vkFreeMemory(device, memory, allocator);
+}
+
+inline VkUnique<VkDeviceMemory> allocateTrackedMemory(VkDevice device, VkDeviceSize size, uint32_t memoryTypeIndex, MemoryCategory category)
+{
+    VkMemoryAllocateInfo allocateInfo = {};
+    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocateInfo.allocationSize = size;
+    allocateInfo.memoryTypeIndex = memoryTypeIndex;
+
+    VkDeviceMemory memory = 0;
+    VK_CHECK(vkAllocateMemory(device, &allocateInfo, 0, &memory));
+
+    getMemoryTracker().trackAllocation(memory, memoryTypeIndex, size, category);
+
+    return makeUnique(device, memory, freeTrackedMemory);
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <stdio.h>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include "MeshProcessing.h"
+
+//Binary cache of processed meshes so processing runs once per source mesh.
+//File is named after a hash of the source data and processing settings, header repeats the hash to catch collisions of names.
+//Layout : MeshCacheHeader, vertices, indices, lods, meshlets, meshletVertices, meshletTriangles
+
+//Bump when processing or file layout changes, old cache files are then ignored
+constexpr uint32_t meshCacheVersion = 2;
+constexpr uint32_t meshCacheMagic = 0x48534d4e; //'NMSH'
+
+struct MeshCacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sourceHash;
+
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t lodCount;
+    uint32_t meshletCount;
+    uint32_t meshletVertexCount;
+    uint32_t meshletTriangleCount;
+
+    float center[3];
+    float radius;
+};
+
+//FNV-1a
+inline uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+inline uint64_t hashMeshSource(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices)
+{
+    const uint32_t settings[] = { meshCacheVersion, meshletMaxVertices, meshletMaxTriangles, meshMaxLods };
+
+    uint64_t hash = hashBytes(settings, sizeof(settings));
+    hash = hashBytes(vertices.data(), vertices.size() * sizeof(Vertex), hash);
+    hash = hashBytes(indices.data(), indices.size() * sizeof(uint32_t), hash);
+
+    return hash;
+}
+
+inline std::string getMeshCachePath(const std::string& cacheDirectory, uint64_t sourceHash)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.mesh", static_cast<unsigned long long>(sourceHash));
+
+    return cacheDirectory + "/" + name;
+}
+
+template<typename T>
+bool readArray(std::ifstream& file, std::vector<T>& data, uint32_t count)
+{
+    data.resize(count);
+    file.read(reinterpret_cast<char*>(data.data()), count * sizeof(T));
+
+    return file.good();
+}
+
+template<typename T>
+void writeArray(std::ofstream& file, const std::vector<T>& data)
+{
+    file.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(T));
+}
+
+inline bool loadMeshCache(const std::string& path, uint64_t sourceHash, ProcessedMesh& outMesh)
+{
+    std::ifstream file(path, std::ios::binary);
+
+    if (!file.is_open())
+    {
+        return false;
+    }
+
+    MeshCacheHeader header = {};
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+    if (!file.good() || header.magic != meshCacheMagic || header.version != meshCacheVersion || header.sourceHash != sourceHash)
+    {
+        return false;
+    }
+
+    ProcessedMesh mesh;
+
+    bool ok = readArray(file, mesh.vertices, header.vertexCount) &&
+              readArray(file, mesh.indices, header.indexCount) &&
+              readArray(file, mesh.lods, header.lodCount) &&
+              readArray(file, mesh.meshlets, header.meshletCount) &&
+              readArray(file, mesh.meshletVertices, header.meshletVertexCount) &&
+              readArray(file, mesh.meshletTriangles, header.meshletTriangleCount);
+
+    if (!ok)
+    {
+        return false;
+    }
+
+    for (int k = 0; k < 3; k++)
+    {
+        mesh.center[k] = header.center[k];
+    }
+    mesh.radius = header.radius;
+
+    outMesh = std::move(mesh);
+
+    return true;
+}
+
+inline bool saveMeshCache(const std::string& path, uint64_t sourceHash, const ProcessedMesh& mesh)
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+
+    if (!file.is_open())
+    {
+        return false;
+    }
+
+    MeshCacheHeader header = {};
+    header.magic = meshCacheMagic;
+    header.version = meshCacheVersion;
+    header.sourceHash = sourceHash;
+    header.vertexCount = static_cast<uint32_t>(mesh.vertices.size());
+    header.indexCount = static_cast<uint32_t>(mesh.indices.size());
+    header.lodCount = static_cast<uint32_t>(mesh.lods.size());
+    header.meshletCount = static_cast<uint32_t>(mesh.meshlets.size());
+    header.meshletVertexCount = static_cast<uint32_t>(mesh.meshletVertices.size());
+    header.meshletTriangleCount = static_cast<uint32_t>(mesh.meshletTriangles.size());
+    for (int k = 0; k < 3; k++)
+    {
+        header.center[k] = mesh.center[k];
+    }
+    header.radius = mesh.radius;
+
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    writeArray(file, mesh.vertices);
+    writeArray(file, mesh.indices);
+    writeArray(file, mesh.lods);
+    writeArray(file, mesh.meshlets);
+    writeArray(file, mesh.meshletVertices);
+    writeArray(file, mesh.meshletTriangles);
+
+    return file.good();
+}
+
+//Loads the cached result when there is one, otherwise processes and writes the cache for next run.
+//outMesh is valid either way, returns false when the cache could not be written so the caller decides how to report it.
+inline bool loadProcessedMesh(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices, const std::string& cacheDirectory, ProcessedMesh& outMesh)
+{
+    uint64_t sourceHash = hashMeshSource(vertices, indices);
+    std::string path = getMeshCachePath(cacheDirectory, sourceHash);
+
+    if (loadMeshCache(path, sourceHash, outMesh))
+    {
+        return true;
+    }
+
+    outMesh = processMesh(vertices, indices);
+
+    //Directory may already exist, a real failure shows up as the write failing
+    std::error_code error;
+    std::filesystem::create_directories(cacheDirectory, error);
+
+    return saveMeshCache(path, sourceHash, outMesh);
+}
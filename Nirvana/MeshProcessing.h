@@ -0,0 +1,579 @@
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+//Mesh processing done once per source mesh (result is cached, see MeshCache.h)
+//1. Vertex cache + vertex fetch optimization of the full detail index buffer
+//2. LOD chain by vertex clustering, every LOD indexes the same vertex buffer
+//3. Meshlets with bounding sphere and normal cone per LOD for cluster culling
+
+//Matches Vertex in triangle.vert.glsl
+struct Vertex
+{
+    float position[3];
+    float normal[3];
+};
+
+//Matches MeshLod in drawcull.comp.glsl
+struct MeshLod
+{
+    uint32_t indexOffset;
+    uint32_t indexCount;
+    uint32_t meshletOffset;
+    uint32_t meshletCount;
+    float error; //Max distance a vertex moved compared to LOD 0, in mesh units
+};
+
+//Matches Meshlet in drawcull.comp.glsl
+//Cone culling : cluster is backfacing for a camera at P when
+//dot(center - P, coneAxis) >= coneCutoff * length(center - P) + radius
+struct Meshlet
+{
+    float center[3];
+    float radius;
+    float coneAxis[3];
+    float coneCutoff;
+
+    uint32_t vertexOffset;   //Into meshletVertices
+    uint32_t triangleOffset; //Into meshletTriangles, 3 local indices per triangle. Triangles keep index buffer order so it is also the first index into indices
+    uint32_t vertexCount;
+    uint32_t triangleCount;
+};
+
+struct ProcessedMesh
+{
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices; //All LODs back to back
+    std::vector<MeshLod> lods;
+
+    std::vector<Meshlet> meshlets;
+    std::vector<uint32_t> meshletVertices;
+    std::vector<uint8_t> meshletTriangles;
+
+    float center[3] = {};
+    float radius = 0.0f;
+};
+
+constexpr uint32_t meshletMaxVertices = 64;
+constexpr uint32_t meshletMaxTriangles = 124;
+constexpr uint32_t meshMaxLods = 8;
+
+//Forsyth, Linear-Speed Vertex Cache Optimisation. 2006
+inline float vertexCacheScore(int cachePosition, uint32_t liveTriangles, int cacheSize)
+{
+    if (liveTriangles == 0)
+    {
+        return -1.0f;
+    }
+
+    float score = 0.0f;
+
+    if (cachePosition >= 0)
+    {
+        //Last triangle's vertices get a fixed score so we do not favour them too much
+        score = (cachePosition < 3) ? 0.75f : powf(1.0f - float(cachePosition - 3) / float(cacheSize - 3), 1.5f);
+    }
+
+    //Prefer vertices with few triangles left so they get retired from the cache
+    score += 2.0f / sqrtf(float(liveTriangles));
+
+    return score;
+}
+
+inline void optimizeVertexCache(std::vector<uint32_t>& indices, size_t vertexCount)
+{
+    const int cacheSize = 32;
+
+    size_t triangleCount = indices.size() / 3;
+
+    if (triangleCount == 0)
+    {
+        return;
+    }
+
+    //Vertex -> triangles adjacency, live counts shrink as triangles are emitted
+    std::vector<uint32_t> liveTriangles(vertexCount, 0);
+    for (uint32_t index : indices)
+    {
+        liveTriangles[index]++;
+    }
+
+    std::vector<uint32_t> adjacencyOffset(vertexCount + 1, 0);
+    for (size_t i = 0; i < vertexCount; i++)
+    {
+        adjacencyOffset[i + 1] = adjacencyOffset[i] + liveTriangles[i];
+    }
+
+    std::vector<uint32_t> adjacency(indices.size());
+    std::vector<uint32_t> adjacencyFill(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+    for (size_t i = 0; i < indices.size(); i++)
+    {
+        adjacency[adjacencyFill[indices[i]]++] = static_cast<uint32_t>(i / 3);
+    }
+
+    std::vector<int> cachePosition(vertexCount, -1);
+    std::vector<float> vertexScore(vertexCount);
+    for (size_t i = 0; i < vertexCount; i++)
+    {
+        vertexScore[i] = vertexCacheScore(-1, liveTriangles[i], cacheSize);
+    }
+
+    std::vector<float> triangleScore(triangleCount);
+    std::vector<bool> emitted(triangleCount, false);
+    for (size_t i = 0; i < triangleCount; i++)
+    {
+        triangleScore[i] = vertexScore[indices[i * 3 + 0]] + vertexScore[indices[i * 3 + 1]] + vertexScore[indices[i * 3 + 2]];
+    }
+
+    std::vector<uint32_t> result;
+    result.reserve(indices.size());
+
+    std::vector<uint32_t> cache;
+    std::vector<uint32_t> newCache;
+    cache.reserve(cacheSize + 3);
+    newCache.reserve(cacheSize + 3);
+
+    size_t scanCursor = 0;
+    size_t best = ~size_t(0);
+
+    //First triangle is the best one overall
+    float bestScore = -FLT_MAX;
+    for (size_t i = 0; i < triangleCount; i++)
+    {
+        if (triangleScore[i] > bestScore)
+        {
+            bestScore = triangleScore[i];
+            best = i;
+        }
+    }
+
+    while (best != ~size_t(0))
+    {
+        emitted[best] = true;
+
+        const uint32_t* tri = &indices[best * 3];
+
+        newCache.clear();
+
+        for (int k = 0; k < 3; k++)
+        {
+            uint32_t v = tri[k];
+            result.push_back(v);
+            newCache.push_back(v);
+
+            //Drop the triangle from the vertex adjacency
+            uint32_t begin = adjacencyOffset[v];
+            uint32_t end = begin + liveTriangles[v];
+            for (uint32_t a = begin; a < end; a++)
+            {
+                if (adjacency[a] == best)
+                {
+                    std::swap(adjacency[a], adjacency[end - 1]);
+                    break;
+                }
+            }
+
+            liveTriangles[v]--;
+        }
+
+        for (uint32_t v : cache)
+        {
+            if (v != tri[0] && v != tri[1] && v != tri[2])
+            {
+                newCache.push_back(v);
+            }
+        }
+
+        //Vertices pushed out of the cache lose their cache score
+        for (size_t i = cacheSize; i < newCache.size(); i++)
+        {
+            cachePosition[newCache[i]] = -1;
+            vertexScore[newCache[i]] = vertexCacheScore(-1, liveTriangles[newCache[i]], cacheSize);
+        }
+
+        if (newCache.size() > size_t(cacheSize))
+        {
+            newCache.resize(cacheSize);
+        }
+
+        cache.swap(newCache);
+
+        //Rescore cached vertices and their remaining triangles, pick the best among them for next step
+        best = ~size_t(0);
+        bestScore = -FLT_MAX;
+
+        for (size_t i = 0; i < cache.size(); i++)
+        {
+            uint32_t v = cache[i];
+            cachePosition[v] = static_cast<int>(i);
+            vertexScore[v] = vertexCacheScore(static_cast<int>(i), liveTriangles[v], cacheSize);
+        }
+
+        for (uint32_t v : cache)
+        {
+            for (uint32_t a = adjacencyOffset[v]; a < adjacencyOffset[v] + liveTriangles[v]; a++)
+            {
+                uint32_t t = adjacency[a];
+                triangleScore[t] = vertexScore[indices[t * 3 + 0]] + vertexScore[indices[t * 3 + 1]] + vertexScore[indices[t * 3 + 2]];
+
+                if (triangleScore[t] > bestScore)
+                {
+                    bestScore = triangleScore[t];
+                    best = t;
+                }
+            }
+        }
+
+        //Nothing adjacent to the cache, continue with the next unemitted triangle
+        if (best == ~size_t(0))
+        {
+            while (scanCursor < triangleCount && emitted[scanCursor])
+            {
+                scanCursor++;
+            }
+
+            if (scanCursor < triangleCount)
+            {
+                best = scanCursor;
+            }
+        }
+    }
+
+    assert(result.size() == indices.size());
+    indices.swap(result);
+}
+
+//Reorders vertices in order of first use so vertex fetch walks memory linearly, drops unreferenced vertices
+inline void optimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices)
+{
+    std::vector<uint32_t> remap(vertices.size(), ~0u);
+    std::vector<Vertex> result;
+    result.reserve(vertices.size());
+
+    for (uint32_t& index : indices)
+    {
+        if (remap[index] == ~0u)
+        {
+            remap[index] = static_cast<uint32_t>(result.size());
+            result.push_back(vertices[index]);
+        }
+
+        index = remap[index];
+    }
+
+    vertices.swap(result);
+}
+
+//Rossignac, Borrel. Multi-resolution 3D approximations for rendering complex scenes. 1993
+//Snaps every vertex to the vertex closest to its grid cell's average and drops collapsed triangles.
+//Picking an existing vertex keeps all LODs on one vertex buffer.
+inline std::vector<uint32_t> simplifyClustered(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices, uint32_t gridSize, float& outError)
+{
+    float minPos[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+    float maxPos[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+    for (const auto& vertex : vertices)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            minPos[k] = std::min(minPos[k], vertex.position[k]);
+            maxPos[k] = std::max(maxPos[k], vertex.position[k]);
+        }
+    }
+
+    float extent = std::max(maxPos[0] - minPos[0], std::max(maxPos[1] - minPos[1], maxPos[2] - minPos[2]));
+    float cellSize = std::max(extent / float(gridSize), FLT_EPSILON);
+
+    auto cellOf = [&](const Vertex& vertex)
+    {
+        uint64_t cell[3];
+        for (int k = 0; k < 3; k++)
+        {
+            cell[k] = std::min(static_cast<uint64_t>((vertex.position[k] - minPos[k]) / cellSize), uint64_t(gridSize - 1));
+        }
+
+        return cell[0] | (cell[1] << 21) | (cell[2] << 42);
+    };
+
+    struct Cell
+    {
+        float sum[3];
+        uint32_t count;
+        uint32_t representative;
+        float bestDistance;
+    };
+
+    std::unordered_map<uint64_t, Cell> cells;
+    std::vector<uint64_t> vertexCell(vertices.size());
+
+    for (size_t i = 0; i < vertices.size(); i++)
+    {
+        vertexCell[i] = cellOf(vertices[i]);
+
+        Cell& cell = cells.emplace(vertexCell[i], Cell{ { 0.0f, 0.0f, 0.0f }, 0, ~0u, FLT_MAX }).first->second;
+        for (int k = 0; k < 3; k++)
+        {
+            cell.sum[k] += vertices[i].position[k];
+        }
+        cell.count++;
+    }
+
+    for (size_t i = 0; i < vertices.size(); i++)
+    {
+        Cell& cell = cells[vertexCell[i]];
+
+        float distance = 0.0f;
+        for (int k = 0; k < 3; k++)
+        {
+            float d = vertices[i].position[k] - cell.sum[k] / float(cell.count);
+            distance += d * d;
+        }
+
+        if (distance < cell.bestDistance)
+        {
+            cell.bestDistance = distance;
+            cell.representative = static_cast<uint32_t>(i);
+        }
+    }
+
+    std::vector<uint32_t> result;
+    result.reserve(indices.size());
+
+    for (size_t i = 0; i < indices.size(); i += 3)
+    {
+        uint32_t a = cells[vertexCell[indices[i + 0]]].representative;
+        uint32_t b = cells[vertexCell[indices[i + 1]]].representative;
+        uint32_t c = cells[vertexCell[indices[i + 2]]].representative;
+
+        if (a != b && b != c && c != a)
+        {
+            result.push_back(a);
+            result.push_back(b);
+            result.push_back(c);
+        }
+    }
+
+    //A vertex can move at most across its cell diagonal
+    outError = cellSize * sqrtf(3.0f);
+
+    return result;
+}
+
+inline void computeBoundingSphere(const std::vector<Vertex>& vertices, const uint32_t* vertexIndices, size_t count, float outCenter[3], float& outRadius)
+{
+    float minPos[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+    float maxPos[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const Vertex& vertex = vertices[vertexIndices ? vertexIndices[i] : i];
+        for (int k = 0; k < 3; k++)
+        {
+            minPos[k] = std::min(minPos[k], vertex.position[k]);
+            maxPos[k] = std::max(maxPos[k], vertex.position[k]);
+        }
+    }
+
+    for (int k = 0; k < 3; k++)
+    {
+        outCenter[k] = (minPos[k] + maxPos[k]) * 0.5f;
+    }
+
+    float radiusSq = 0.0f;
+    for (size_t i = 0; i < count; i++)
+    {
+        const Vertex& vertex = vertices[vertexIndices ? vertexIndices[i] : i];
+
+        float d[3] = { vertex.position[0] - outCenter[0], vertex.position[1] - outCenter[1], vertex.position[2] - outCenter[2] };
+        radiusSq = std::max(radiusSq, d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+    }
+
+    outRadius = sqrtf(radiusSq);
+}
+
+inline void computeMeshletBounds(Meshlet& meshlet, const std::vector<Vertex>& vertices, const std::vector<uint32_t>& meshletVertices, const std::vector<uint8_t>& meshletTriangles)
+{
+    const uint32_t* localVertices = &meshletVertices[meshlet.vertexOffset];
+    const uint8_t* localTriangles = &meshletTriangles[meshlet.triangleOffset];
+
+    computeBoundingSphere(vertices, localVertices, meshlet.vertexCount, meshlet.center, meshlet.radius);
+
+    //Normal cone, axis is the average triangle normal and cutoff covers the widest deviation from it
+    std::vector<float> normals;
+    normals.reserve(meshlet.triangleCount * 3);
+
+    float axis[3] = {};
+
+    for (uint32_t i = 0; i < meshlet.triangleCount; i++)
+    {
+        const float* p0 = vertices[localVertices[localTriangles[i * 3 + 0]]].position;
+        const float* p1 = vertices[localVertices[localTriangles[i * 3 + 1]]].position;
+        const float* p2 = vertices[localVertices[localTriangles[i * 3 + 2]]].position;
+
+        float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+        float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+        float n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+
+        float length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        if (length == 0.0f)
+        {
+            continue;
+        }
+
+        for (int k = 0; k < 3; k++)
+        {
+            normals.push_back(n[k] / length);
+            axis[k] += n[k] / length;
+        }
+    }
+
+    float axisLength = sqrtf(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+
+    //Cutoff of 1 never passes the cone test so degenerate clusters are never cone culled
+    meshlet.coneAxis[0] = 0.0f;
+    meshlet.coneAxis[1] = 0.0f;
+    meshlet.coneAxis[2] = 1.0f;
+    meshlet.coneCutoff = 1.0f;
+
+    if (axisLength == 0.0f)
+    {
+        return;
+    }
+
+    float minDot = 1.0f;
+    for (size_t i = 0; i < normals.size(); i += 3)
+    {
+        float d = (normals[i + 0] * axis[0] + normals[i + 1] * axis[1] + normals[i + 2] * axis[2]) / axisLength;
+        minDot = std::min(minDot, d);
+    }
+
+    if (minDot <= 0.0f)
+    {
+        return; //Normals span more than a hemisphere
+    }
+
+    for (int k = 0; k < 3; k++)
+    {
+        meshlet.coneAxis[k] = axis[k] / axisLength;
+    }
+
+    meshlet.coneCutoff = sqrtf(1.0f - minDot * minDot);
+}
+
+//Greedy partitioning in index order, works well after vertex cache optimization since nearby triangles are close in the index buffer
+inline void buildMeshlets(ProcessedMesh& mesh, const uint32_t* indices, size_t indexCount)
+{
+    std::vector<uint8_t> localIndex(mesh.vertices.size(), 0xff);
+
+    Meshlet meshlet = {};
+    meshlet.vertexOffset = static_cast<uint32_t>(mesh.meshletVertices.size());
+    meshlet.triangleOffset = static_cast<uint32_t>(mesh.meshletTriangles.size());
+
+    auto finish = [&]()
+    {
+        for (uint32_t i = 0; i < meshlet.vertexCount; i++)
+        {
+            localIndex[mesh.meshletVertices[meshlet.vertexOffset + i]] = 0xff;
+        }
+
+        computeMeshletBounds(meshlet, mesh.vertices, mesh.meshletVertices, mesh.meshletTriangles);
+        mesh.meshlets.push_back(meshlet);
+
+        meshlet = {};
+        meshlet.vertexOffset = static_cast<uint32_t>(mesh.meshletVertices.size());
+        meshlet.triangleOffset = static_cast<uint32_t>(mesh.meshletTriangles.size());
+    };
+
+    for (size_t i = 0; i < indexCount; i += 3)
+    {
+        uint32_t a = indices[i + 0];
+        uint32_t b = indices[i + 1];
+        uint32_t c = indices[i + 2];
+
+        uint32_t newVertices = (localIndex[a] == 0xff) + (localIndex[b] == 0xff) + (localIndex[c] == 0xff);
+
+        if (meshlet.vertexCount + newVertices > meshletMaxVertices || meshlet.triangleCount + 1 > meshletMaxTriangles)
+        {
+            finish();
+        }
+
+        for (uint32_t v : { a, b, c })
+        {
+            if (localIndex[v] == 0xff)
+            {
+                localIndex[v] = static_cast<uint8_t>(meshlet.vertexCount++);
+                mesh.meshletVertices.push_back(v);
+            }
+
+            mesh.meshletTriangles.push_back(localIndex[v]);
+        }
+
+        meshlet.triangleCount++;
+    }
+
+    if (meshlet.triangleCount != 0)
+    {
+        finish();
+    }
+}
+
+inline ProcessedMesh processMesh(const std::vector<Vertex>& sourceVertices, const std::vector<uint32_t>& sourceIndices)
+{
+    ProcessedMesh mesh;
+    mesh.vertices = sourceVertices;
+
+    std::vector<uint32_t> lod0 = sourceIndices;
+    optimizeVertexCache(lod0, mesh.vertices.size());
+    optimizeVertexFetch(mesh.vertices, lod0);
+
+    computeBoundingSphere(mesh.vertices, nullptr, mesh.vertices.size(), mesh.center, mesh.radius);
+
+    std::vector<std::vector<uint32_t>> lodIndices;
+    std::vector<float> lodErrors;
+
+    lodIndices.push_back(lod0);
+    lodErrors.push_back(0.0f);
+
+    //Halving the grid roughly quarters the vertex count of a surface each step
+    for (uint32_t gridSize = 64; gridSize >= 2 && lodIndices.size() < meshMaxLods; gridSize /= 2)
+    {
+        float error = 0.0f;
+        std::vector<uint32_t> lod = simplifyClustered(mesh.vertices, lodIndices.back(), gridSize, error);
+
+        //Skip grid sizes that are still too fine to remove a quarter of the triangles, or that collapse everything
+        if (lod.empty() || lod.size() * 4 > lodIndices.back().size() * 3)
+        {
+            continue;
+        }
+
+        optimizeVertexCache(lod, mesh.vertices.size());
+
+        //Each LOD is simplified from the previous one so displacement accumulates
+        lodIndices.push_back(lod);
+        lodErrors.push_back(lodErrors.back() + error);
+    }
+
+    for (size_t i = 0; i < lodIndices.size(); i++)
+    {
+        MeshLod lod = {};
+        lod.indexOffset = static_cast<uint32_t>(mesh.indices.size());
+        lod.indexCount = static_cast<uint32_t>(lodIndices[i].size());
+        lod.meshletOffset = static_cast<uint32_t>(mesh.meshlets.size());
+        lod.error = lodErrors[i];
+
+        mesh.indices.insert(mesh.indices.end(), lodIndices[i].begin(), lodIndices[i].end());
+
+        buildMeshlets(mesh, lodIndices[i].data(), lodIndices[i].size());
+        lod.meshletCount = static_cast<uint32_t>(mesh.meshlets.size()) - lod.meshletOffset;
+
+        mesh.lods.push_back(lod);
+    }
+
+    return mesh;
+}
@@ -0,0 +1,582 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include "Resources.h"
+#include "Pipelines.h"
+#include "Permutations.h"
+
+//Two phase occlusion culling
+//Early : objects are tested against depth pyramid built from the previous frame, survivors are drawn
+//Pyramid : depth of the early draws is reduced into a min depth mip chain (reverse Z so min is farthest)
+//Late : objects rejected early are re-tested against the new pyramid and drawn if now visible
+//Pyramid stays around and becomes "previous frame" depth for the next frame
+
+//Matches VkDrawIndexedIndirectCommand, cull shader writes one per object per phase and one per meshlet of objects it splits
+struct DrawCommand
+{
+    uint32_t indexCount;
+    uint32_t instanceCount;
+    uint32_t firstIndex;
+    int32_t vertexOffset;
+    uint32_t firstInstance;
+};
+
+//Matches specialization constants in drawcull.comp.glsl
+struct CullLate : SpecFeature<0> {};
+struct CullOcclusion : SpecFeature<1> {};
+struct DrawCullShader : ShaderFeatures<ShaderDrawCull, CullLate, CullOcclusion> {};
+
+//Matches CullData push constants in drawcull.comp.glsl
+struct CullData
+{
+    float frustum[4];
+    float P00, P11;
+    float znear;
+    float pyramidWidth, pyramidHeight;
+    uint32_t objectCount;
+    uint32_t lodCount;
+    float lodTarget; //Allowed LOD error per unit of distance, see drawcull.comp.glsl
+    uint32_t meshletCapacity;
+};
+
+//Matches Stats buffer in drawcull.comp.glsl
+struct CullCounters
+{
+    uint32_t visibleCount;
+    uint32_t frustumCulledCount;
+    uint32_t occludedCount;
+    uint32_t triangleCount;
+    uint32_t meshletCulledCount;
+    uint32_t meshletSlots[2];
+};
+
+struct OcclusionStats
+{
+    uint32_t objectCount = 0;
+    uint32_t visibleCount = 0;
+    uint32_t frustumCulledCount = 0;
+    uint32_t occludedCount = 0;
+    uint32_t triangleCount = 0; //Submitted by both passes after LOD selection and meshlet culling
+    uint32_t meshletCulledCount = 0; //Frustum or cone culled meshlets of visible objects
+
+    bool timingsValid = false; //Timings are left at 0 when the device can not write timestamps
+    double cullEarlyMs = 0.0;
+    double pyramidMs = 0.0;
+    double cullLateMs = 0.0;
+};
+
+enum OcclusionTimestamp
+{
+    TimestampCullEarlyBegin,
+    TimestampCullEarlyEnd,
+    TimestampPyramidBegin,
+    TimestampPyramidEnd,
+    TimestampCullLateBegin,
+    TimestampCullLateEnd,
+    TimestampCount
+};
+
+//Meshlet draw slots per pass, objects that no longer fit are drawn whole
+constexpr uint32_t meshletDrawCapacity = 16384;
+
+//Memory eviction shrinks the pyramid by at most 8x per side
+constexpr uint32_t maxPyramidShift = 3;
+
+struct OcclusionCulling
+{
+    uint32_t objectCount = 0;
+    uint32_t lodCount = 0;
+    uint32_t framesInFlight = 0;
+    bool timestampsSupported = false;
+    float timestampPeriod = 0.0f; //Nanoseconds per tick
+    uint64_t timestampMask = 0; //Queue may write fewer than 64 valid bits
+
+    VkBuffer objects = VK_NULL_HANDLE; //Owned by the scene
+    VkBuffer lods = VK_NULL_HANDLE; //MeshLod per LOD, owned by the scene
+    VkBuffer meshlets = VK_NULL_HANDLE; //Meshlets of all LODs, owned by the scene
+
+    Image pyramid;
+    std::vector<VkUnique<VkImageView>> pyramidLevels;
+    uint32_t pyramidWidth = 0;
+    uint32_t pyramidHeight = 0;
+    uint32_t pyramidShift = 0; //Levels dropped to give memory back when the heap is over budget, 0 is full size
+    bool pyramidValid = false;
+
+    VkUnique<VkSampler> sampler;
+
+    Buffer draws;       //2 * objectCount DrawCommand early then late, followed by 2 * meshletDrawCapacity the same way
+    Buffer visibility;  //objectCount uint
+    Buffer counters;    //CullCounters, device local
+    std::vector<Buffer> readback; //CullCounters per frame in flight, host visible
+
+    VkUnique<VkQueryPool> queryPool; //TimestampCount queries per frame in flight, null without timestamp support
+    std::vector<bool> slotsRecorded; //Queries and readback of a slot are undefined until it has been recorded once
+
+    VkUnique<VkDescriptorPool> descriptorPool; //Holds the reduce sets and the cull set, recreated with the pyramid
+
+    VkUnique<VkDescriptorSetLayout> reduceSetLayout;
+    VkUnique<VkPipelineLayout> reduceLayout;
+    VkUnique<VkPipeline> reducePipeline;
+    std::vector<VkDescriptorSet> reduceSets; //One per pyramid level
+
+    VkUnique<VkDescriptorSetLayout> cullSetLayout;
+    VkUnique<VkPipelineLayout> cullLayout;
+    //Owned by the PermutationCache, first frame has no pyramid to test against
+    VkPipeline cullFirstFramePipeline = VK_NULL_HANDLE;
+    VkPipeline cullEarlyPipeline = VK_NULL_HANDLE;
+    VkPipeline cullLatePipeline = VK_NULL_HANDLE;
+    VkDescriptorSet cullSet = VK_NULL_HANDLE;
+};
+
+inline uint32_t previousPow2(uint32_t v)
+{
+    uint32_t r = 1;
+
+    while (r * 2 <= v)
+    {
+        r *= 2;
+    }
+
+    return r;
+}
+
+inline uint32_t getMipLevelCount(uint32_t imageWidth, uint32_t imageHeight)
+{
+    uint32_t levels = 1;
+
+    while (imageWidth > 1 || imageHeight > 1)
+    {
+        levels++;
+        imageWidth /= 2;
+        imageHeight /= 2;
+    }
+
+    return levels;
+}
+
+inline VkSampler createPyramidSampler(VkDevice device)
+{
+    VkSamplerCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    createInfo.magFilter = VK_FILTER_NEAREST;
+    createInfo.minFilter = VK_FILTER_NEAREST;
+    createInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    createInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    createInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    createInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    createInfo.minLod = 0.0f;
+    createInfo.maxLod = 16.0f;
+
+    VkSampler sampler = 0;
+    VK_CHECK(vkCreateSampler(device, &createInfo, 0, &sampler));
+
+    return sampler;
+}
+
+//Pyramid follows the depth buffer size, everything that references its levels is created along with it
+inline void createPyramidTargets(OcclusionCulling& culling, VkDevice device, const VkPhysicalDeviceMemoryProperties& memoryProperties,
+                                 VkImageView depthView, uint32_t depthWidth, uint32_t depthHeight)
+{
+    //Power of two pyramid so every level is an exact 2x reduction of the previous one.
+    //A shifted level 0 still covers the whole depth buffer, reduction takes the min of a larger footprint.
+    culling.pyramidWidth = std::max(previousPow2(depthWidth) >> culling.pyramidShift, 1u);
+    culling.pyramidHeight = std::max(previousPow2(depthHeight) >> culling.pyramidShift, 1u);
+    uint32_t levelCount = getMipLevelCount(culling.pyramidWidth, culling.pyramidHeight);
+
+    culling.pyramid = createImage(device, memoryProperties, culling.pyramidWidth, culling.pyramidHeight, levelCount, VK_FORMAT_R32_SFLOAT,
+                                  VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT, VK_IMAGE_ASPECT_COLOR_BIT);
+
+    culling.pyramidLevels.resize(levelCount);
+    for (uint32_t i = 0; i < levelCount; i++)
+    {
+        culling.pyramidLevels[i] = makeUnique(device, createSubresourceView(device, culling.pyramid.image, VK_FORMAT_R32_SFLOAT, VK_IMAGE_ASPECT_COLOR_BIT, i, 1), vkDestroyImageView);
+    }
+
+    //New pyramid has undefined contents, first frame on it skips the early occlusion test
+    culling.pyramidValid = false;
+
+    culling.descriptorPool = makeUnique(device, createDescriptorPool(device, levelCount + 1), vkDestroyDescriptorPool);
+
+    culling.reduceSets.resize(levelCount);
+    for (uint32_t i = 0; i < levelCount; i++)
+    {
+        VkDescriptorSet set = allocateDescriptorSet(device, culling.descriptorPool, culling.reduceSetLayout);
+
+        //Level 0 reads the depth buffer, rest read the previous level
+        VkImageView source = (i == 0) ? depthView : culling.pyramidLevels[i - 1].get();
+        VkImageLayout sourceLayout = (i == 0) ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL;
+
+        writeImageDescriptor(device, set, 0, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, culling.pyramidLevels[i], VK_IMAGE_LAYOUT_GENERAL);
+        writeImageDescriptor(device, set, 1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, source, sourceLayout, culling.sampler);
+
+        culling.reduceSets[i] = set;
+    }
+
+    culling.cullSet = allocateDescriptorSet(device, culling.descriptorPool, culling.cullSetLayout);
+    writeBufferDescriptor(device, culling.cullSet, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, culling.objects);
+    writeBufferDescriptor(device, culling.cullSet, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, culling.draws.buffer);
+    writeBufferDescriptor(device, culling.cullSet, 2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, culling.visibility.buffer);
+    writeBufferDescriptor(device, culling.cullSet, 3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, culling.counters.buffer);
+    writeImageDescriptor(device, culling.cullSet, 4, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, culling.pyramid.view, VK_IMAGE_LAYOUT_GENERAL, culling.sampler);
+    writeBufferDescriptor(device, culling.cullSet, 5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, culling.lods);
+    writeBufferDescriptor(device, culling.cullSet, 6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, culling.meshlets);
+}
+
+inline void createOcclusionCulling(OcclusionCulling& culling, VkDevice device, const VkPhysicalDeviceMemoryProperties& memoryProperties, const VkPhysicalDeviceLimits& limits,
+                                   uint32_t timestampValidBits, VkImageView depthView, uint32_t depthWidth, uint32_t depthHeight, VkBuffer objects, uint32_t objectCount,
+                                   VkBuffer lods, uint32_t lodCount, VkBuffer meshlets, uint32_t framesInFlight, VkShaderModule reduceShader, VkShaderModule cullShader,
+                                   PermutationCache& pipelines)
+{
+    //Both graphics and compute stages write timestamps on the queue, GPU timings are reported as unavailable otherwise
+    culling.timestampsSupported = limits.timestampComputeAndGraphics && timestampValidBits != 0;
+
+    culling.objects = objects;
+    culling.objectCount = objectCount;
+    culling.lods = lods;
+    culling.lodCount = lodCount;
+    culling.meshlets = meshlets;
+    culling.framesInFlight = framesInFlight;
+    culling.timestampPeriod = limits.timestampPeriod;
+    culling.timestampMask = (timestampValidBits >= 64) ? ~0ull : (1ull << timestampValidBits) - 1;
+
+    culling.sampler = makeUnique(device, createPyramidSampler(device), vkDestroySampler);
+
+    culling.draws = createBuffer(device, memoryProperties, 2 * (objectCount + meshletDrawCapacity) * sizeof(DrawCommand),
+                                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    culling.visibility = createBuffer(device, memoryProperties, objectCount * sizeof(uint32_t),
+                                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    culling.counters = createBuffer(device, memoryProperties, sizeof(CullCounters),
+                                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    culling.readback.resize(framesInFlight);
+    for (auto& buffer : culling.readback)
+    {
+        buffer = createBuffer(device, memoryProperties, sizeof(CullCounters), VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                              VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    }
+
+    if (culling.timestampsSupported)
+    {
+        VkQueryPoolCreateInfo queryCreateInfo = {};
+        queryCreateInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryCreateInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryCreateInfo.queryCount = TimestampCount * framesInFlight;
+
+        VkQueryPool queryPool = 0;
+        VK_CHECK(vkCreateQueryPool(device, &queryCreateInfo, 0, &queryPool));
+        culling.queryPool = makeUnique(device, queryPool, vkDestroyQueryPool);
+    }
+
+    culling.slotsRecorded.assign(framesInFlight, false);
+
+    //Pyramid reduction
+    VkDescriptorSetLayoutBinding reduceBindings[] =
+    {
+        { 0, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0 },
+        { 1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0 },
+    };
+
+    culling.reduceSetLayout = makeUnique(device, createDescriptorSetLayout(device, reduceBindings, sizeof(reduceBindings) / sizeof(reduceBindings[0])), vkDestroyDescriptorSetLayout);
+    culling.reduceLayout = makeUnique(device, createPipelineLayout(device, culling.reduceSetLayout, 4 * sizeof(int32_t), VK_SHADER_STAGE_COMPUTE_BIT), vkDestroyPipelineLayout);
+    culling.reducePipeline = makeUnique(device, createComputePipeline(device, reduceShader, culling.reduceLayout), vkDestroyPipeline);
+
+    //Culling
+    VkDescriptorSetLayoutBinding cullBindings[] =
+    {
+        { 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0 },
+        { 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0 },
+        { 2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0 },
+        { 3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0 },
+        { 4, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0 },
+        { 5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0 },
+        { 6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0 },
+    };
+
+    culling.cullSetLayout = makeUnique(device, createDescriptorSetLayout(device, cullBindings, sizeof(cullBindings) / sizeof(cullBindings[0])), vkDestroyDescriptorSetLayout);
+    culling.cullLayout = makeUnique(device, createPipelineLayout(device, culling.cullSetLayout, sizeof(CullData), VK_SHADER_STAGE_COMPUTE_BIT), vkDestroyPipelineLayout);
+
+    VkPipelineLayout cullLayout = culling.cullLayout;
+    auto createCull = [device, cullShader, cullLayout](const VkSpecializationInfo* specializationInfo)
+    {
+        return createComputePipeline(device, cullShader, cullLayout, specializationInfo);
+    };
+
+    culling.cullFirstFramePipeline = pipelines.get<DrawCullShader, FeatureSet<>>(device, createCull);
+    culling.cullEarlyPipeline = pipelines.get<DrawCullShader, FeatureSet<CullOcclusion>>(device, createCull);
+    culling.cullLatePipeline = pipelines.get<DrawCullShader, FeatureSet<CullLate, CullOcclusion>>(device, createCull);
+
+    createPyramidTargets(culling, device, memoryProperties, depthView, depthWidth, depthHeight);
+}
+
+//Call after the depth buffer was recreated, frames in flight keep sampling the old pyramid until lastUse retires
+inline void resizeOcclusionCulling(OcclusionCulling& culling, DeletionQueue& deletionQueue, uint64_t lastUse, VkDevice device, const VkPhysicalDeviceMemoryProperties& memoryProperties,
+                                   VkImageView depthView, uint32_t depthWidth, uint32_t depthHeight)
+{
+    //Sets are freed with their pool
+    deletionQueue.push(lastUse, std::move(culling.descriptorPool));
+    culling.reduceSets.clear();
+    culling.cullSet = VK_NULL_HANDLE;
+
+    for (auto& level : culling.pyramidLevels)
+    {
+        deletionQueue.push(lastUse, std::move(level));
+    }
+    culling.pyramidLevels.clear();
+
+    retireImage(deletionQueue, lastUse, culling.pyramid);
+
+    createPyramidTargets(culling, device, memoryProperties, depthView, depthWidth, depthHeight);
+}
+
+//Eviction consumer. Coarser pyramids stay conservative, they just reject fewer objects.
+//Each shift quarters the pyramid, it is shifted far enough to release bytesToFree or until maxPyramidShift.
+//Returns the bytes released, they count as free once lastUse retires.
+inline VkDeviceSize evictDepthPyramid(OcclusionCulling& culling, DeletionQueue& deletionQueue, uint64_t lastUse, VkDevice device, const VkPhysicalDeviceMemoryProperties& memoryProperties,
+                                      VkImageView depthView, uint32_t depthWidth, uint32_t depthHeight, uint32_t heapIndex, VkDeviceSize bytesToFree)
+{
+    uint32_t pyramidHeap = 0;
+    VkDeviceSize pyramidSize = 0;
+
+    if (!getMemoryTracker().getAllocation(culling.pyramid.memory, pyramidHeap, pyramidSize) || pyramidHeap != heapIndex || culling.pyramidShift == maxPyramidShift)
+    {
+        return 0;
+    }
+
+    VkDeviceSize remainingSize = pyramidSize;
+    uint32_t shift = culling.pyramidShift;
+
+    do
+    {
+        remainingSize /= 4;
+        shift++;
+    } while (pyramidSize - remainingSize < bytesToFree && shift < maxPyramidShift);
+
+    culling.pyramidShift = shift;
+    resizeOcclusionCulling(culling, deletionQueue, lastUse, device, memoryProperties, depthView, depthWidth, depthHeight);
+
+    VkDeviceSize newSize = 0;
+    getMemoryTracker().getAllocation(culling.pyramid.memory, pyramidHeap, newSize);
+
+    return newSize < pyramidSize ? pyramidSize - newSize : 0;
+}
+
+//Undoes one step of evictDepthPyramid once the heap has room for it again, call once per frame before recording
+inline void restoreDepthPyramid(OcclusionCulling& culling, DeletionQueue& deletionQueue, uint64_t lastUse, VkDevice device, const VkPhysicalDeviceMemoryProperties& memoryProperties,
+                                VkImageView depthView, uint32_t depthWidth, uint32_t depthHeight)
+{
+    uint32_t pyramidHeap = 0;
+    VkDeviceSize pyramidSize = 0;
+
+    if (culling.pyramidShift == 0 || !getMemoryTracker().getAllocation(culling.pyramid.memory, pyramidHeap, pyramidSize))
+    {
+        return;
+    }
+
+    //The next step up is about four times the current pyramid
+    if (getMemoryTracker().hasHeadroom(pyramidHeap, 4 * pyramidSize))
+    {
+        culling.pyramidShift--;
+        resizeOcclusionCulling(culling, deletionQueue, lastUse, device, memoryProperties, depthView, depthWidth, depthHeight);
+    }
+}
+
+//Resets this frame's queries and counters, must be recorded outside of a render pass before any cull pass
+inline void beginOcclusionFrame(VkCommandBuffer cmdBuffer, OcclusionCulling& culling, uint32_t frameIndex)
+{
+    if (culling.timestampsSupported)
+    {
+        vkCmdResetQueryPool(cmdBuffer, culling.queryPool, frameIndex * TimestampCount, TimestampCount);
+    }
+
+    culling.slotsRecorded[frameIndex] = true;
+
+    if (!culling.pyramidValid)
+    {
+        VkImageMemoryBarrier pyramidBarrier = imageBarrier(culling.pyramid.image, 0, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+                                                           VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
+
+        vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, 0, 0, 1, &pyramidBarrier);
+    }
+
+    //Previous frame may still be reading draws as indirect args or counters in a copy
+    VkMemoryBarrier fillBarrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    fillBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    fillBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &fillBarrier, 0, 0, 0, 0);
+
+    vkCmdFillBuffer(cmdBuffer, culling.counters.buffer, 0, sizeof(CullCounters), 0);
+
+    //Meshlet slots a pass does not reserve are still drawn, zero instances makes them no-ops
+    VkDeviceSize meshletDrawOffset = 2 * culling.objectCount * sizeof(DrawCommand);
+    vkCmdFillBuffer(cmdBuffer, culling.draws.buffer, meshletDrawOffset, 2 * meshletDrawCapacity * sizeof(DrawCommand), 0);
+
+    VkBufferMemoryBarrier clearBarriers[] =
+    {
+        bufferBarrier(culling.counters.buffer, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT),
+        bufferBarrier(culling.draws.buffer, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_WRITE_BIT),
+    };
+
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, sizeof(clearBarriers) / sizeof(clearBarriers[0]), clearBarriers, 0, 0);
+}
+
+inline void writeOcclusionTimestamp(VkCommandBuffer cmdBuffer, const OcclusionCulling& culling, VkPipelineStageFlagBits stage, uint32_t query)
+{
+    if (culling.timestampsSupported)
+    {
+        vkCmdWriteTimestamp(cmdBuffer, stage, culling.queryPool, query);
+    }
+}
+
+//View dependent part of cullData (frustum, projection, lodTarget) comes from the caller, rest is filled here
+inline void recordCullPass(VkCommandBuffer cmdBuffer, OcclusionCulling& culling, uint32_t frameIndex, bool late, const CullData& view)
+{
+    uint32_t queryBase = frameIndex * TimestampCount + (late ? TimestampCullLateBegin : TimestampCullEarlyBegin);
+
+    writeOcclusionTimestamp(cmdBuffer, culling, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryBase);
+
+    CullData cullData = view;
+    cullData.pyramidWidth = static_cast<float>(culling.pyramidWidth);
+    cullData.pyramidHeight = static_cast<float>(culling.pyramidHeight);
+    cullData.objectCount = culling.objectCount;
+    cullData.lodCount = culling.lodCount;
+    cullData.meshletCapacity = meshletDrawCapacity;
+
+    VkPipeline pipeline = late ? culling.cullLatePipeline : (culling.pyramidValid ? culling.cullEarlyPipeline : culling.cullFirstFramePipeline);
+
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, culling.cullLayout, 0, 1, &culling.cullSet, 0, 0);
+    vkCmdPushConstants(cmdBuffer, culling.cullLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(cullData), &cullData);
+    vkCmdDispatch(cmdBuffer, getGroupCount(culling.objectCount, 64), 1, 1);
+
+    //Draw commands are consumed as indirect args by the following render pass, visibility and counters by the late pass
+    VkMemoryBarrier cullBarrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    cullBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    cullBarrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &cullBarrier, 0, 0, 0, 0);
+
+    writeOcclusionTimestamp(cmdBuffer, culling, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryBase + 1);
+}
+
+//Index buffer with all LODs of the mesh must be bound
+inline void recordDrawPass(VkCommandBuffer cmdBuffer, OcclusionCulling& culling, bool late)
+{
+    VkDeviceSize objectOffset = late ? culling.objectCount * sizeof(DrawCommand) : 0;
+    VkDeviceSize meshletOffset = (2 * culling.objectCount + (late ? meshletDrawCapacity : 0)) * sizeof(DrawCommand);
+
+    vkCmdDrawIndexedIndirect(cmdBuffer, culling.draws.buffer, objectOffset, culling.objectCount, sizeof(DrawCommand));
+    vkCmdDrawIndexedIndirect(cmdBuffer, culling.draws.buffer, meshletOffset, meshletDrawCapacity, sizeof(DrawCommand));
+}
+
+//Reduces depth of the early pass into the pyramid, depth image is expected in depth attachment layout and is returned to it
+inline void recordDepthPyramid(VkCommandBuffer cmdBuffer, OcclusionCulling& culling, uint32_t frameIndex, VkImage depthImage, uint32_t depthWidth, uint32_t depthHeight)
+{
+    writeOcclusionTimestamp(cmdBuffer, culling, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frameIndex * TimestampCount + TimestampPyramidBegin);
+
+    VkImageMemoryBarrier depthReadBarrier = imageBarrier(depthImage, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
+                                                         VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_ASPECT_DEPTH_BIT);
+
+    //Early cull pass sampled the pyramid we are about to overwrite
+    VkImageMemoryBarrier pyramidWriteBarrier = imageBarrier(culling.pyramid.image, VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+                                                            VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL);
+
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, 0, 0, 1, &depthReadBarrier);
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, 0, 0, 1, &pyramidWriteBarrier);
+
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, culling.reducePipeline);
+
+    int32_t inWidth = static_cast<int32_t>(depthWidth);
+    int32_t inHeight = static_cast<int32_t>(depthHeight);
+
+    for (uint32_t i = 0; i < culling.pyramid.mipLevels; i++)
+    {
+        int32_t outWidth = std::max(static_cast<int32_t>(culling.pyramidWidth >> i), 1);
+        int32_t outHeight = std::max(static_cast<int32_t>(culling.pyramidHeight >> i), 1);
+
+        int32_t reduceData[4] = { inWidth, inHeight, outWidth, outHeight };
+
+        vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, culling.reduceLayout, 0, 1, &culling.reduceSets[i], 0, 0);
+        vkCmdPushConstants(cmdBuffer, culling.reduceLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(reduceData), reduceData);
+        vkCmdDispatch(cmdBuffer, getGroupCount(outWidth, 16), getGroupCount(outHeight, 16), 1);
+
+        //Next level reads this one, late cull pass reads all of them
+        VkImageMemoryBarrier levelBarrier = imageBarrier(culling.pyramid.image, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
+                                                         VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_ASPECT_COLOR_BIT, i, 1);
+
+        vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, 0, 0, 0, 1, &levelBarrier);
+
+        inWidth = outWidth;
+        inHeight = outHeight;
+    }
+
+    VkImageMemoryBarrier depthWriteBarrier = imageBarrier(depthImage, VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                                                          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_ASPECT_DEPTH_BIT);
+
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                         0, 0, 0, 0, 0, 1, &depthWriteBarrier);
+
+    writeOcclusionTimestamp(cmdBuffer, culling, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frameIndex * TimestampCount + TimestampPyramidEnd);
+
+    culling.pyramidValid = true;
+}
+
+//Copies counters of this frame to its readback slot, results are available once the frame's fence signals.
+//Meant for a command buffer of the SubmitReadback stage, the barrier orders it after the cull passes on the same queue.
+inline void endOcclusionFrame(VkCommandBuffer cmdBuffer, OcclusionCulling& culling, uint32_t frameIndex)
+{
+    VkBufferMemoryBarrier copyBarrier = bufferBarrier(culling.counters.buffer, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, 0, 1, &copyBarrier, 0, 0);
+
+    VkBufferCopy region = { 0, 0, sizeof(CullCounters) };
+    vkCmdCopyBuffer(cmdBuffer, culling.counters.buffer, culling.readback[frameIndex].buffer, 1, &region);
+
+    VkBufferMemoryBarrier hostBarrier = bufferBarrier(culling.readback[frameIndex].buffer, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT);
+
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, 0, 1, &hostBarrier, 0, 0);
+}
+
+//Call after waiting on the fence of frameIndex, returns results recorded the last time this slot was used
+inline bool readOcclusionStats(VkDevice device, const OcclusionCulling& culling, uint32_t frameIndex, OcclusionStats& outStats)
+{
+    if (!culling.slotsRecorded[frameIndex])
+    {
+        return false;
+    }
+
+    const CullCounters* counters = static_cast<const CullCounters*>(culling.readback[frameIndex].data);
+
+    outStats.objectCount = culling.objectCount;
+    outStats.visibleCount = counters->visibleCount;
+    outStats.frustumCulledCount = counters->frustumCulledCount;
+    outStats.occludedCount = counters->occludedCount;
+    outStats.triangleCount = counters->triangleCount;
+    outStats.meshletCulledCount = counters->meshletCulledCount;
+
+    if (!culling.timestampsSupported)
+    {
+        return true;
+    }
+
+    uint64_t timestamps[TimestampCount] = {};
+
+    VkResult result = vkGetQueryPoolResults(device, culling.queryPool, frameIndex * TimestampCount, TimestampCount, sizeof(timestamps), timestamps,
+                                            sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+
+    if (result != VK_SUCCESS)
+    {
+        return true;
+    }
+
+    double msPerTick = culling.timestampPeriod * 1e-6;
+
+    outStats.timingsValid = true;
+    outStats.cullEarlyMs = double((timestamps[TimestampCullEarlyEnd] - timestamps[TimestampCullEarlyBegin]) & culling.timestampMask) * msPerTick;
+    outStats.pyramidMs = double((timestamps[TimestampPyramidEnd] - timestamps[TimestampPyramidBegin]) & culling.timestampMask) * msPerTick;
+    outStats.cullLateMs = double((timestamps[TimestampCullLateEnd] - timestamps[TimestampCullLateBegin]) & culling.timestampMask) * msPerTick;
+
+    return true;
+}
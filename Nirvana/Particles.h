@@ -0,0 +1,430 @@
+#pragma once
+
+#include <stddef.h>
+#include "Resources.h"
+#include "Pipelines.h"
+#include "Permutations.h"
+
+//GPU particles, the CPU records the same handful of commands whatever the particle count
+//Reset : new buffers start with every slot on the dead list, no upload needed
+//Prepare : one thread clamps the emit request to free slots and writes indirect dispatch args
+//Emit : pops free slots off the dead list and appends them to the alive list
+//Simulate : integrates alive particles, dead ones go back to the dead list, living ones are compacted
+//           into the other alive list along with a view depth sort key
+//Finalize : one thread writes the sort dispatch and this frame's draw args from the live count
+//Sort : LSD radix sort of the live list by depth, farthest first for alpha blending. The last pass copies
+//       position and fade of the sorted particles into the draw data of the frame being recorded
+//Draw : vkCmdDrawIndirect instanced quads, instance count is the live count
+//Particle attributes are SoA storage buffers indexed by particle slot, the alive lists hold slots.
+//Draw data is per frame in flight, so the update of the next frame overlaps the draw of this one on the async
+//compute queue. The frame's fence guarantees the draw data an update writes is no longer read.
+
+//Matches specialization constants in particleupdate.comp.glsl and radixsort.comp.glsl
+struct ParticleFinalize : SpecFeature<0> {};
+struct ParticleUpdateShader : ShaderFeatures<ShaderParticleUpdate, ParticleFinalize> {};
+
+struct RadixScan : SpecFeature<0> {};
+struct RadixScatter : SpecFeature<1> {};
+struct RadixDrawOutput : SpecFeature<2> {};
+struct RadixSortShader : ShaderFeatures<ShaderRadixSort, RadixScan, RadixScatter, RadixDrawOutput> {};
+
+//Matches radixsort.comp.glsl, keys are 16 bit so two 8 bit digit passes sort them
+constexpr uint32_t radixBits = 8;
+constexpr uint32_t radixPassCount = 2;
+constexpr uint32_t radixBlockSize = 1024; //256 threads * 4 keys
+
+//Scan is one workgroup looping over every block, 4096 blocks is 4M particles. Past that it needs a hierarchical scan.
+constexpr uint32_t radixMaxBlocks = 4096;
+
+//Memory eviction lowers capacity by at most 16x
+constexpr uint32_t maxParticleShift = 4;
+
+//Matches Counters buffer in the particle shaders, dispatch args are consumed indirectly
+struct ParticleCounters
+{
+    VkDispatchIndirectCommand emitDispatch;
+    VkDispatchIndirectCommand simulateDispatch;
+    VkDispatchIndirectCommand sortDispatch;
+
+    uint32_t aliveCount;
+    uint32_t deadCount;
+    uint32_t emitCount;
+    uint32_t newAliveCount;
+};
+
+//Matches Params push constants in the particle compute shaders
+struct ParticleParams
+{
+    float emitterPosition[3]; //View space like the rest of the scene
+    float emitterRadius;
+    float gravity[3];
+    float deltaTime;
+    float lifetime;
+    float speed;
+    float size;
+    uint32_t emitRequest; //Clamped to free slots on the GPU
+    uint32_t seed;
+    uint32_t radixShift;
+    uint32_t maxParticles;
+    uint32_t drawSet;
+};
+
+struct ParticleSystem
+{
+    uint32_t maxParticles = 0;
+    uint32_t capacityShift = 0; //Capacity is maxParticles >> capacityShift, raised to give memory back when the heap is over budget
+    uint32_t capacity = 0;
+    uint32_t framesInFlight = 0;
+    uint32_t frameParity = 0; //Alive list the next update reads
+    bool needsReset = true;   //Buffers were just created, the next update starts with the reset pass
+
+    uint32_t queueFamilies[2] = {};
+    uint32_t queueFamilyCount = 0;
+
+    //SoA attributes, one entry per slot
+    Buffer positions;  //vec4 xyz, size
+    Buffer velocities; //vec4 xyz
+    Buffer lives;      //vec2 age, lifetime
+
+    Buffer deadList;
+    Buffer counters;     //ParticleCounters
+    Buffer keys[2];      //Sort keys of the alive lists
+    Buffer aliveLists[2];
+    Buffer histograms;   //256 per sort block
+
+    //capacity entries per frame in flight, written by the last sort pass and read by the draw
+    Buffer drawPositions; //vec4 xyz, size
+    Buffer drawFades;     //float
+    Buffer drawArgs;      //VkDrawIndirectCommand per frame in flight
+
+    VkUnique<VkDescriptorPool> descriptorPool; //Recreated with the buffers
+
+    VkUnique<VkDescriptorSetLayout> computeSetLayout;
+    VkUnique<VkPipelineLayout> computeLayout;
+    VkDescriptorSet computeSets[2] = {}; //Reads alive list i and writes alive list 1 - i
+
+    //Owned by the PermutationCache
+    VkPipeline preparePipeline = VK_NULL_HANDLE;
+    VkPipeline finalizePipeline = VK_NULL_HANDLE;
+    VkPipeline radixCountPipeline = VK_NULL_HANDLE;
+    VkPipeline radixScanPipeline = VK_NULL_HANDLE;
+    VkPipeline radixScatterPipeline = VK_NULL_HANDLE;
+    VkPipeline radixScatterDrawPipeline = VK_NULL_HANDLE;
+
+    VkUnique<VkPipeline> resetPipeline;
+    VkUnique<VkPipeline> emitPipeline;
+    VkUnique<VkPipeline> simulatePipeline;
+
+    VkUnique<VkDescriptorSetLayout> drawSetLayout;
+    VkDescriptorSet drawSet = VK_NULL_HANDLE; //Draw data of every frame, the draw args pick the frame's range
+};
+
+//Compute work of one pass visible to the next pass and to indirect commands
+inline void particleBarrier(VkCommandBuffer cmdBuffer)
+{
+    VkMemoryBarrier barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0, 1, &barrier, 0, 0, 0, 0);
+}
+
+//Buffers and the sets that reference them, sized by the current capacity
+inline void createParticleBuffers(ParticleSystem& particles, VkDevice device, const VkPhysicalDeviceMemoryProperties& memoryProperties)
+{
+    particles.capacity = std::max(particles.maxParticles >> particles.capacityShift, 1u);
+    particles.frameParity = 0;
+    particles.needsReset = true;
+
+    uint32_t capacity = particles.capacity;
+    uint32_t queueFamilyCount = particles.queueFamilyCount;
+    const uint32_t* queueFamilies = particles.queueFamilies;
+
+    const VkBufferUsageFlags storage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    const VkMemoryPropertyFlags local = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+
+    particles.positions = createBuffer(device, memoryProperties, capacity * 4 * sizeof(float), storage, local, queueFamilyCount, queueFamilies);
+    particles.velocities = createBuffer(device, memoryProperties, capacity * 4 * sizeof(float), storage, local, queueFamilyCount, queueFamilies);
+    particles.lives = createBuffer(device, memoryProperties, capacity * 2 * sizeof(float), storage, local, queueFamilyCount, queueFamilies);
+    particles.deadList = createBuffer(device, memoryProperties, capacity * sizeof(uint32_t), storage, local, queueFamilyCount, queueFamilies);
+    particles.counters = createBuffer(device, memoryProperties, sizeof(ParticleCounters), storage | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, local, queueFamilyCount, queueFamilies);
+
+    for (int i = 0; i < 2; i++)
+    {
+        particles.keys[i] = createBuffer(device, memoryProperties, capacity * sizeof(uint32_t), storage, local, queueFamilyCount, queueFamilies);
+        particles.aliveLists[i] = createBuffer(device, memoryProperties, capacity * sizeof(uint32_t), storage, local, queueFamilyCount, queueFamilies);
+    }
+
+    uint32_t blockCount = getGroupCount(capacity, radixBlockSize);
+    particles.histograms = createBuffer(device, memoryProperties, blockCount * (1 << radixBits) * sizeof(uint32_t), storage, local, queueFamilyCount, queueFamilies);
+
+    uint32_t drawCount = capacity * particles.framesInFlight;
+    particles.drawPositions = createBuffer(device, memoryProperties, drawCount * 4 * sizeof(float), storage, local, queueFamilyCount, queueFamilies);
+    particles.drawFades = createBuffer(device, memoryProperties, drawCount * sizeof(float), storage, local, queueFamilyCount, queueFamilies);
+    particles.drawArgs = createBuffer(device, memoryProperties, particles.framesInFlight * sizeof(VkDrawIndirectCommand), storage | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                                      local, queueFamilyCount, queueFamilies);
+
+    particles.descriptorPool = makeUnique(device, createDescriptorPool(device, 3), vkDestroyDescriptorPool);
+
+    for (int i = 0; i < 2; i++)
+    {
+        VkDescriptorSet set = allocateDescriptorSet(device, particles.descriptorPool, particles.computeSetLayout);
+
+        writeBufferDescriptor(device, set, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, particles.positions.buffer);
+        writeBufferDescriptor(device, set, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, particles.velocities.buffer);
+        writeBufferDescriptor(device, set, 2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, particles.lives.buffer);
+        writeBufferDescriptor(device, set, 3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, particles.deadList.buffer);
+        writeBufferDescriptor(device, set, 4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, particles.counters.buffer);
+        writeBufferDescriptor(device, set, 5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, particles.keys[i].buffer);
+        writeBufferDescriptor(device, set, 6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, particles.aliveLists[i].buffer);
+        writeBufferDescriptor(device, set, 7, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, particles.keys[1 - i].buffer);
+        writeBufferDescriptor(device, set, 8, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, particles.aliveLists[1 - i].buffer);
+        writeBufferDescriptor(device, set, 9, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, particles.histograms.buffer);
+        writeBufferDescriptor(device, set, 10, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, particles.drawPositions.buffer);
+        writeBufferDescriptor(device, set, 11, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, particles.drawFades.buffer);
+        writeBufferDescriptor(device, set, 12, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, particles.drawArgs.buffer);
+
+        particles.computeSets[i] = set;
+    }
+
+    particles.drawSet = allocateDescriptorSet(device, particles.descriptorPool, particles.drawSetLayout);
+    writeBufferDescriptor(device, particles.drawSet, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, particles.drawPositions.buffer);
+    writeBufferDescriptor(device, particles.drawSet, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, particles.drawFades.buffer);
+}
+
+//queueFamilies are the families that touch particle buffers (compute and graphics), draw data is kept per frame in flight
+inline void createParticleSystem(ParticleSystem& particles, VkDevice device, const VkPhysicalDeviceMemoryProperties& memoryProperties, uint32_t maxParticles,
+                                 uint32_t framesInFlight, const uint32_t* queueFamilies, uint32_t queueFamilyCount, VkShaderModule resetShader,
+                                 VkShaderModule updateShader, VkShaderModule emitShader, VkShaderModule simulateShader, VkShaderModule sortShader, PermutationCache& pipelines)
+{
+    assert(getGroupCount(maxParticles, radixBlockSize) <= radixMaxBlocks);
+    assert(queueFamilyCount <= 2);
+
+    particles.maxParticles = maxParticles;
+    particles.framesInFlight = framesInFlight;
+    particles.queueFamilyCount = queueFamilyCount;
+    for (uint32_t i = 0; i < queueFamilyCount; i++)
+    {
+        particles.queueFamilies[i] = queueFamilies[i];
+    }
+
+    //Bindings match the particle compute shaders, each uses the subset it needs
+    VkDescriptorSetLayoutBinding computeBindings[13];
+    for (uint32_t i = 0; i < 13; i++)
+    {
+        computeBindings[i] = { i, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT, 0 };
+    }
+
+    particles.computeSetLayout = makeUnique(device, createDescriptorSetLayout(device, computeBindings, sizeof(computeBindings) / sizeof(computeBindings[0])), vkDestroyDescriptorSetLayout);
+    particles.computeLayout = makeUnique(device, createPipelineLayout(device, particles.computeSetLayout, sizeof(ParticleParams), VK_SHADER_STAGE_COMPUTE_BIT), vkDestroyPipelineLayout);
+
+    VkPipelineLayout computeLayout = particles.computeLayout;
+    auto createUpdate = [device, updateShader, computeLayout](const VkSpecializationInfo* specializationInfo)
+    {
+        return createComputePipeline(device, updateShader, computeLayout, specializationInfo);
+    };
+    auto createSort = [device, sortShader, computeLayout](const VkSpecializationInfo* specializationInfo)
+    {
+        return createComputePipeline(device, sortShader, computeLayout, specializationInfo);
+    };
+
+    particles.preparePipeline = pipelines.get<ParticleUpdateShader, FeatureSet<>>(device, createUpdate);
+    particles.finalizePipeline = pipelines.get<ParticleUpdateShader, FeatureSet<ParticleFinalize>>(device, createUpdate);
+    particles.radixCountPipeline = pipelines.get<RadixSortShader, FeatureSet<>>(device, createSort);
+    particles.radixScanPipeline = pipelines.get<RadixSortShader, FeatureSet<RadixScan>>(device, createSort);
+    particles.radixScatterPipeline = pipelines.get<RadixSortShader, FeatureSet<RadixScatter>>(device, createSort);
+    particles.radixScatterDrawPipeline = pipelines.get<RadixSortShader, FeatureSet<RadixScatter, RadixDrawOutput>>(device, createSort);
+
+    particles.resetPipeline = makeUnique(device, createComputePipeline(device, resetShader, particles.computeLayout), vkDestroyPipeline);
+    particles.emitPipeline = makeUnique(device, createComputePipeline(device, emitShader, particles.computeLayout), vkDestroyPipeline);
+    particles.simulatePipeline = makeUnique(device, createComputePipeline(device, simulateShader, particles.computeLayout), vkDestroyPipeline);
+
+    //Matches particle.vert.glsl
+    VkDescriptorSetLayoutBinding drawBindings[] =
+    {
+        { 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT, 0 },
+        { 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT, 0 },
+    };
+
+    particles.drawSetLayout = makeUnique(device, createDescriptorSetLayout(device, drawBindings, sizeof(drawBindings) / sizeof(drawBindings[0])), vkDestroyDescriptorSetLayout);
+
+    createParticleBuffers(particles, device, memoryProperties);
+}
+
+//Recreates the buffers at the current capacityShift, frames in flight keep using the old ones until lastUse retires.
+//Live particles are dropped, the emitter fills the new buffers again.
+inline void resizeParticleSystem(ParticleSystem& particles, DeletionQueue& deletionQueue, uint64_t lastUse, VkDevice device, const VkPhysicalDeviceMemoryProperties& memoryProperties)
+{
+    //Sets are freed with their pool
+    deletionQueue.push(lastUse, std::move(particles.descriptorPool));
+    particles.computeSets[0] = particles.computeSets[1] = VK_NULL_HANDLE;
+    particles.drawSet = VK_NULL_HANDLE;
+
+    Buffer* buffers[] =
+    {
+        &particles.positions, &particles.velocities, &particles.lives, &particles.deadList, &particles.counters,
+        &particles.keys[0], &particles.keys[1], &particles.aliveLists[0], &particles.aliveLists[1], &particles.histograms,
+        &particles.drawPositions, &particles.drawFades, &particles.drawArgs,
+    };
+
+    for (Buffer* buffer : buffers)
+    {
+        retireBuffer(deletionQueue, lastUse, *buffer);
+    }
+
+    createParticleBuffers(particles, device, memoryProperties);
+}
+
+//Bytes of particle buffers on heapIndex
+inline VkDeviceSize getParticleMemory(const ParticleSystem& particles, uint32_t heapIndex)
+{
+    const Buffer* buffers[] =
+    {
+        &particles.positions, &particles.velocities, &particles.lives, &particles.deadList, &particles.counters,
+        &particles.keys[0], &particles.keys[1], &particles.aliveLists[0], &particles.aliveLists[1], &particles.histograms,
+        &particles.drawPositions, &particles.drawFades, &particles.drawArgs,
+    };
+
+    VkDeviceSize total = 0;
+
+    for (const Buffer* buffer : buffers)
+    {
+        uint32_t bufferHeap = 0;
+        VkDeviceSize size = 0;
+
+        if (getMemoryTracker().getAllocation(buffer->memory, bufferHeap, size) && bufferHeap == heapIndex)
+        {
+            total += size;
+        }
+    }
+
+    return total;
+}
+
+//Eviction consumer, halves capacity until bytesToFree are released or maxParticleShift is reached.
+//Returns the bytes released, they count as free once lastUse retires.
+inline VkDeviceSize evictParticleSystem(ParticleSystem& particles, DeletionQueue& deletionQueue, uint64_t lastUse, VkDevice device, const VkPhysicalDeviceMemoryProperties& memoryProperties,
+                                        uint32_t heapIndex, VkDeviceSize bytesToFree)
+{
+    VkDeviceSize particleSize = getParticleMemory(particles, heapIndex);
+
+    if (particleSize == 0 || particles.capacityShift == maxParticleShift)
+    {
+        return 0;
+    }
+
+    VkDeviceSize remainingSize = particleSize;
+    uint32_t shift = particles.capacityShift;
+
+    do
+    {
+        remainingSize /= 2;
+        shift++;
+    } while (particleSize - remainingSize < bytesToFree && shift < maxParticleShift);
+
+    particles.capacityShift = shift;
+    resizeParticleSystem(particles, deletionQueue, lastUse, device, memoryProperties);
+
+    VkDeviceSize newSize = getParticleMemory(particles, heapIndex);
+
+    return newSize < particleSize ? particleSize - newSize : 0;
+}
+
+//Undoes one step of evictParticleSystem once the heap has room for it again, call once per frame before recording
+inline void restoreParticleSystem(ParticleSystem& particles, DeletionQueue& deletionQueue, uint64_t lastUse, VkDevice device, const VkPhysicalDeviceMemoryProperties& memoryProperties)
+{
+    uint32_t heapIndex = 0;
+    VkDeviceSize size = 0;
+
+    if (particles.capacityShift == 0 || !getMemoryTracker().getAllocation(particles.positions.memory, heapIndex, size))
+    {
+        return;
+    }
+
+    //Twice the capacity is about twice the memory
+    if (getMemoryTracker().hasHeadroom(heapIndex, 2 * getParticleMemory(particles, heapIndex)))
+    {
+        particles.capacityShift--;
+        resizeParticleSystem(particles, deletionQueue, lastUse, device, memoryProperties);
+    }
+}
+
+//Records the whole update, emitter/physics settings come from the caller, the rest is filled here.
+//drawSet is the frame in flight, the sorted result goes into its draw data.
+inline void recordParticleUpdate(VkCommandBuffer cmdBuffer, ParticleSystem& particles, const ParticleParams& settings, uint32_t drawSet)
+{
+    assert(drawSet < particles.framesInFlight);
+
+    ParticleParams params = settings;
+    params.maxParticles = particles.capacity;
+    params.radixShift = 0;
+    params.drawSet = drawSet;
+
+    uint32_t in = particles.frameParity;
+    uint32_t out = 1 - in;
+
+    //Previous update was submitted to this queue, its writes have to land before this one reads them
+    particleBarrier(cmdBuffer);
+
+    vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, particles.computeLayout, 0, 1, &particles.computeSets[in], 0, 0);
+    vkCmdPushConstants(cmdBuffer, particles.computeLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), &params);
+
+    if (particles.needsReset)
+    {
+        vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, particles.resetPipeline);
+        vkCmdDispatch(cmdBuffer, getGroupCount(particles.capacity, 64), 1, 1);
+        particleBarrier(cmdBuffer);
+
+        particles.needsReset = false;
+    }
+
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, particles.preparePipeline);
+    vkCmdDispatch(cmdBuffer, 1, 1, 1);
+    particleBarrier(cmdBuffer);
+
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, particles.emitPipeline);
+    vkCmdDispatchIndirect(cmdBuffer, particles.counters.buffer, offsetof(ParticleCounters, emitDispatch));
+    particleBarrier(cmdBuffer);
+
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, particles.simulatePipeline);
+    vkCmdDispatchIndirect(cmdBuffer, particles.counters.buffer, offsetof(ParticleCounters, simulateDispatch));
+    particleBarrier(cmdBuffer);
+
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, particles.finalizePipeline);
+    vkCmdDispatch(cmdBuffer, 1, 1, 1);
+    particleBarrier(cmdBuffer);
+
+    //Ping-pongs between the alive lists, an even pass count leaves the result where simulate wrote it
+    static_assert(radixPassCount % 2 == 0, "Sorted list has to end up in the out list");
+
+    for (uint32_t pass = 0; pass < radixPassCount; pass++)
+    {
+        uint32_t source = (pass % 2 == 0) ? out : in;
+        params.radixShift = pass * radixBits;
+
+        vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, particles.computeLayout, 0, 1, &particles.computeSets[source], 0, 0);
+        vkCmdPushConstants(cmdBuffer, particles.computeLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), &params);
+
+        vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, particles.radixCountPipeline);
+        vkCmdDispatchIndirect(cmdBuffer, particles.counters.buffer, offsetof(ParticleCounters, sortDispatch));
+        particleBarrier(cmdBuffer);
+
+        vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, particles.radixScanPipeline);
+        vkCmdDispatch(cmdBuffer, 1, 1, 1);
+        particleBarrier(cmdBuffer);
+
+        bool last = pass + 1 == radixPassCount;
+        vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, last ? particles.radixScatterDrawPipeline : particles.radixScatterPipeline);
+        vkCmdDispatchIndirect(cmdBuffer, particles.counters.buffer, offsetof(ParticleCounters, sortDispatch));
+        particleBarrier(cmdBuffer);
+    }
+
+    particles.frameParity = out;
+}
+
+//Draw data the update of drawSet wrote, pipeline layout must use drawSetLayout at set 0
+inline void recordParticleDraw(VkCommandBuffer cmdBuffer, const ParticleSystem& particles, VkPipelineLayout pipelineLayout, uint32_t drawSet)
+{
+    vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &particles.drawSet, 0, 0);
+    vkCmdDrawIndirect(cmdBuffer, particles.drawArgs.buffer, drawSet * sizeof(VkDrawIndirectCommand), 1, sizeof(VkDrawIndirectCommand));
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <unordered_map>
+#include <utility>
+#include "Handles.h"
+
+//Shader permutations as specialization constants : one SPIR-V module per shader, variants differ only in
+//VkSpecializationInfo so the driver folds the branches away at pipeline creation. Feature sets are types,
+//so a key can only name features its shader declares and all variants are known at compile time.
+//
+//GLSL side declares each feature as : layout(constant_id = N) const bool NAME = false;
+//C++ side : struct Name : SpecFeature<N> {};
+
+//Shaders that have permutations, part of every pipeline key
+enum ShaderId : uint32_t
+{
+    ShaderDrawCull,
+    ShaderParticleUpdate,
+    ShaderRadixSort,
+    ShaderLightBin,
+};
+
+template<uint32_t ConstantId>
+struct SpecFeature
+{
+    static_assert(ConstantId < 32, "Feature masks are 32 bit");
+
+    static constexpr uint32_t constantId = ConstantId;
+    static constexpr uint32_t bit = 1u << ConstantId;
+};
+
+template<typename... Features>
+struct FeatureSet
+{
+    static constexpr uint32_t mask = (0u | ... | Features::bit);
+};
+
+//Every feature a shader declares, Id is the ShaderId
+template<ShaderId Id, typename... Features>
+struct ShaderFeatures
+{
+    static_assert(sizeof...(Features) > 0, "Shader without features does not need permutations");
+
+    static constexpr ShaderId id = Id;
+    static constexpr uint32_t count = sizeof...(Features);
+    static constexpr uint32_t mask = (0u | ... | Features::bit);
+    static constexpr uint32_t constantIds[] = { Features::constantId... };
+
+    template<typename Set>
+    static constexpr bool contains = (Set::mask & ~mask) == 0;
+};
+
+struct PipelineKey
+{
+    ShaderId shader;
+    uint32_t features; //FeatureSet mask
+
+    bool operator==(const PipelineKey& other) const
+    {
+        return shader == other.shader && features == other.features;
+    }
+};
+
+struct PipelineKeyHash
+{
+    size_t operator()(const PipelineKey& key) const
+    {
+        return (static_cast<size_t>(key.shader) * 0x9e3779b9u) ^ key.features;
+    }
+};
+
+template<typename Shader, typename Set>
+constexpr PipelineKey makePipelineKey()
+{
+    static_assert(Shader::template contains<Set>, "Feature set names a feature the shader does not declare");
+
+    return { Shader::id, Set::mask };
+}
+
+//One VkBool32 per declared feature, features outside the mask are specialized to false
+template<typename Shader>
+struct Specialization
+{
+    VkSpecializationMapEntry entries[Shader::count];
+    VkBool32 values[Shader::count];
+    VkSpecializationInfo info;
+
+    explicit Specialization(uint32_t features)
+    {
+        for (uint32_t i = 0; i < Shader::count; i++)
+        {
+            entries[i].constantID = Shader::constantIds[i];
+            entries[i].offset = i * sizeof(VkBool32);
+            entries[i].size = sizeof(VkBool32);
+
+            values[i] = (features & (1u << Shader::constantIds[i])) ? VK_TRUE : VK_FALSE;
+        }
+
+        info.mapEntryCount = Shader::count;
+        info.pMapEntries = entries;
+        info.dataSize = sizeof(values);
+        info.pData = values;
+    }
+
+    //info points into this object
+    Specialization(const Specialization&) = delete;
+    Specialization& operator=(const Specialization&) = delete;
+};
+
+//Owns every pipeline variant, create them up front so nothing is compiled while rendering
+class PermutationCache
+{
+public:
+    //create(const VkSpecializationInfo*) returns a new VkPipeline, only called when the key is not cached yet
+    template<typename Shader, typename Set, typename CreateFn>
+    VkPipeline get(VkDevice device, CreateFn&& create)
+    {
+        PipelineKey key = makePipelineKey<Shader, Set>();
+
+        auto it = pipelines.find(key);
+        if (it != pipelines.end())
+        {
+            return it->second;
+        }
+
+        Specialization<Shader> specialization(Set::mask);
+
+        VkPipeline pipeline = create(&specialization.info);
+        assert(pipeline);
+
+        pipelines.emplace(key, makeUnique(device, pipeline, vkDestroyPipeline));
+
+        return pipeline;
+    }
+
+    size_t size() const
+    {
+        return pipelines.size();
+    }
+
+private:
+    std::unordered_map<PipelineKey, VkUnique<VkPipeline>, PipelineKeyHash> pipelines;
+};
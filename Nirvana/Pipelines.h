@@ -0,0 +1,127 @@
+#pragma once
+
+#include "Handles.h"
+
+inline uint32_t getGroupCount(uint32_t threadCount, uint32_t localSize)
+{
+    return (threadCount + localSize - 1) / localSize;
+}
+
+inline VkDescriptorSetLayout createDescriptorSetLayout(VkDevice device, const VkDescriptorSetLayoutBinding* bindings, uint32_t bindingCount)
+{
+    VkDescriptorSetLayoutCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    createInfo.bindingCount = bindingCount;
+    createInfo.pBindings = bindings;
+
+    VkDescriptorSetLayout setLayout = 0;
+    VK_CHECK(vkCreateDescriptorSetLayout(device, &createInfo, 0, &setLayout));
+
+    return setLayout;
+}
+
+//One pool per subsystem, sized generously since sets are allocated once at startup and never freed individually
+inline VkDescriptorPool createDescriptorPool(VkDevice device, uint32_t maxSets)
+{
+    VkDescriptorPoolSize poolSizes[] =
+    {
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, maxSets * 8 },
+        { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, maxSets * 2 },
+        { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, maxSets * 2 },
+        { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, maxSets * 2 },
+    };
+
+    VkDescriptorPoolCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    createInfo.maxSets = maxSets;
+    createInfo.poolSizeCount = sizeof(poolSizes) / sizeof(poolSizes[0]);
+    createInfo.pPoolSizes = poolSizes;
+
+    VkDescriptorPool pool = 0;
+    VK_CHECK(vkCreateDescriptorPool(device, &createInfo, 0, &pool));
+
+    return pool;
+}
+
+inline VkDescriptorSet allocateDescriptorSet(VkDevice device, VkDescriptorPool pool, VkDescriptorSetLayout setLayout)
+{
+    VkDescriptorSetAllocateInfo allocateInfo = {};
+    allocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocateInfo.descriptorPool = pool;
+    allocateInfo.descriptorSetCount = 1;
+    allocateInfo.pSetLayouts = &setLayout;
+
+    VkDescriptorSet set = 0;
+    VK_CHECK(vkAllocateDescriptorSets(device, &allocateInfo, &set));
+
+    return set;
+}
+
+inline void writeBufferDescriptor(VkDevice device, VkDescriptorSet set, uint32_t binding, VkDescriptorType type, VkBuffer buffer)
+{
+    VkDescriptorBufferInfo bufferInfo = { buffer, 0, VK_WHOLE_SIZE };
+
+    VkWriteDescriptorSet write = {};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = set;
+    write.dstBinding = binding;
+    write.descriptorCount = 1;
+    write.descriptorType = type;
+    write.pBufferInfo = &bufferInfo;
+
+    vkUpdateDescriptorSets(device, 1, &write, 0, 0);
+}
+
+inline void writeImageDescriptor(VkDevice device, VkDescriptorSet set, uint32_t binding, VkDescriptorType type, VkImageView view, VkImageLayout layout, VkSampler sampler = VK_NULL_HANDLE)
+{
+    VkDescriptorImageInfo imageInfo = { sampler, view, layout };
+
+    VkWriteDescriptorSet write = {};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = set;
+    write.dstBinding = binding;
+    write.descriptorCount = 1;
+    write.descriptorType = type;
+    write.pImageInfo = &imageInfo;
+
+    vkUpdateDescriptorSets(device, 1, &write, 0, 0);
+}
+
+inline VkPipelineLayout createPipelineLayout(VkDevice device, VkDescriptorSetLayout setLayout, uint32_t pushConstantSize, VkShaderStageFlags pushConstantStages)
+{
+    VkPushConstantRange pushConstantRange = { pushConstantStages, 0, pushConstantSize };
+
+    VkPipelineLayoutCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    createInfo.setLayoutCount = setLayout ? 1 : 0;
+    createInfo.pSetLayouts = &setLayout;
+    createInfo.pushConstantRangeCount = pushConstantSize ? 1 : 0;
+    createInfo.pPushConstantRanges = &pushConstantRange;
+
+    VkPipelineLayout pipelineLayout = 0;
+    VK_CHECK(vkCreatePipelineLayout(device, &createInfo, 0, &pipelineLayout));
+
+    return pipelineLayout;
+}
+
+inline VkPipeline createComputePipeline(VkDevice device, VkShaderModule cs, VkPipelineLayout pipelineLayout, const VkSpecializationInfo* specializationInfo = nullptr)
+{
+    VkPipelineShaderStageCreateInfo stageCreateInfo = {};
+    stageCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    stageCreateInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    stageCreateInfo.module = cs;
+    stageCreateInfo.pName = "main";
+    stageCreateInfo.pSpecializationInfo = specializationInfo;
+
+    VkComputePipelineCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    createInfo.stage = stageCreateInfo;
+    createInfo.layout = pipelineLayout;
+    createInfo.basePipelineHandle = VK_NULL_HANDLE;
+    createInfo.basePipelineIndex = -1;
+
+    VkPipeline pipeline = 0;
+    VK_CHECK(vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &createInfo, 0, &pipeline));
+
+    return pipeline;
+}
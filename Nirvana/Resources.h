@@ -0,0 +1,269 @@
+#pragma once
+
+#include <string.h>
+#include <vector>
+#include "Handles.h"
+#include "DeletionQueue.h"
+#include "MemoryBudget.h"
+
+struct Buffer
+{
+    VkUnique<VkBuffer> buffer;
+    VkUnique<VkDeviceMemory> memory;
+    void* data = nullptr; //Persistently mapped when memory is host visible
+    VkDeviceSize size = 0;
+};
+
+struct Image
+{
+    VkUnique<VkImage> image;
+    VkUnique<VkDeviceMemory> memory;
+    VkUnique<VkImageView> view; //Covers all mip levels
+    VkFormat format = VK_FORMAT_UNDEFINED;
+    uint32_t mipLevels = 0;
+};
+
+inline uint32_t findMemoryType(const VkPhysicalDeviceMemoryProperties& memoryProperties, uint32_t typeBits, VkMemoryPropertyFlags flags)
+{
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
+    {
+        if ((typeBits & (1 << i)) != 0 && (memoryProperties.memoryTypes[i].propertyFlags & flags) == flags)
+        {
+            return i;
+        }
+    }
+
+    assert(!"No compatible memory type");
+    return ~0u;
+}
+
+//Host visible buffers that are only copied from are staging, everything else counts as a buffer
+inline MemoryCategory getBufferMemoryCategory(VkBufferUsageFlags usage, VkMemoryPropertyFlags memoryFlags)
+{
+    bool hostVisible = (memoryFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0;
+
+    return hostVisible && usage == VK_BUFFER_USAGE_TRANSFER_SRC_BIT ? MemoryStaging : MemoryBuffer;
+}
+
+//Images the GPU writes every frame are attachments, sampled only images are textures
+inline MemoryCategory getImageMemoryCategory(VkImageUsageFlags usage)
+{
+    const VkImageUsageFlags written = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_STORAGE_BIT;
+
+    return (usage & written) ? MemoryAttachment : MemoryTexture;
+}
+
+//Buffers used by more than one queue family are concurrent so no ownership transfers are needed, pass those families
+inline Buffer createBuffer(VkDevice device, const VkPhysicalDeviceMemoryProperties& memoryProperties, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memoryFlags,
+                           uint32_t queueFamilyCount = 0, const uint32_t* queueFamilyIndices = nullptr)
+{
+    Buffer result;
+
+    VkBufferCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    createInfo.size = size;
+    createInfo.usage = usage;
+    createInfo.sharingMode = queueFamilyCount > 1 ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE;
+    createInfo.queueFamilyIndexCount = queueFamilyCount > 1 ? queueFamilyCount : 0;
+    createInfo.pQueueFamilyIndices = queueFamilyIndices;
+
+    VkBuffer buffer = 0;
+    VK_CHECK(vkCreateBuffer(device, &createInfo, 0, &buffer));
+    result.buffer = makeUnique(device, buffer, vkDestroyBuffer);
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(device, buffer, &requirements);
+
+    uint32_t memoryTypeIndex = findMemoryType(memoryProperties, requirements.memoryTypeBits, memoryFlags);
+    result.memory = allocateTrackedMemory(device, requirements.size, memoryTypeIndex, getBufferMemoryCategory(usage, memoryFlags));
+
+    VK_CHECK(vkBindBufferMemory(device, buffer, result.memory, 0));
+
+    if (memoryFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+    {
+        VK_CHECK(vkMapMemory(device, result.memory, 0, size, 0, &result.data));
+    }
+
+    result.size = size;
+
+    return result;
+}
+
+//Destroyed once retireValue has retired, until then the tracker knows the memory is on its way out
+inline void retireBuffer(DeletionQueue& deletionQueue, uint64_t retireValue, Buffer& buffer)
+{
+    if (buffer.memory)
+    {
+        getMemoryTracker().trackPendingFree(buffer.memory);
+    }
+
+    deletionQueue.push(retireValue, std::move(buffer.buffer));
+    deletionQueue.push(retireValue, std::move(buffer.memory));
+
+    buffer.data = nullptr;
+    buffer.size = 0;
+}
+
+//Copies recorded into one command buffer that the submission scheduler sends along with other work.
+//Staging buffers have to stay alive until that submission retires.
+struct UploadBatch
+{
+    VkCommandBuffer cmdBuffer = VK_NULL_HANDLE;
+    std::vector<Buffer> staging;
+};
+
+inline UploadBatch beginUploadBatch(VkDevice device, VkCommandPool commandPool)
+{
+    UploadBatch batch;
+
+    VkCommandBufferAllocateInfo allocateInfo = {};
+    allocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocateInfo.commandBufferCount = 1;
+    allocateInfo.commandPool = commandPool;
+    allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+
+    VK_CHECK(vkAllocateCommandBuffers(device, &allocateInfo, &batch.cmdBuffer));
+
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    VK_CHECK(vkBeginCommandBuffer(batch.cmdBuffer, &beginInfo));
+
+    return batch;
+}
+
+inline void uploadBuffer(VkDevice device, const VkPhysicalDeviceMemoryProperties& memoryProperties, UploadBatch& batch,
+                         const Buffer& buffer, const void* data, VkDeviceSize size)
+{
+    assert(size <= buffer.size);
+
+    Buffer staging = createBuffer(device, memoryProperties, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    memcpy(staging.data, data, size);
+
+    VkBufferCopy region = { 0, 0, size };
+    vkCmdCopyBuffer(batch.cmdBuffer, staging.buffer, buffer.buffer, 1, &region);
+
+    batch.staging.push_back(std::move(staging));
+}
+
+//Later submissions on the queue see the copies, command buffer is ready to submit
+inline void endUploadBatch(UploadBatch& batch)
+{
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+
+    vkCmdPipelineBarrier(batch.cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &barrier, 0, 0, 0, 0);
+
+    VK_CHECK(vkEndCommandBuffer(batch.cmdBuffer));
+}
+
+inline VkImageView createSubresourceView(VkDevice device, VkImage image, VkFormat format, VkImageAspectFlags aspectMask, uint32_t baseMipLevel, uint32_t levelCount)
+{
+    VkImageViewCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    createInfo.image = image;
+    createInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    createInfo.format = format;
+    createInfo.subresourceRange.aspectMask = aspectMask;
+    createInfo.subresourceRange.baseMipLevel = baseMipLevel;
+    createInfo.subresourceRange.levelCount = levelCount;
+    createInfo.subresourceRange.baseArrayLayer = 0;
+    createInfo.subresourceRange.layerCount = 1;
+
+    VkImageView view = 0;
+    VK_CHECK(vkCreateImageView(device, &createInfo, 0, &view));
+
+    return view;
+}
+
+inline Image createImage(VkDevice device, const VkPhysicalDeviceMemoryProperties& memoryProperties, uint32_t imageWidth, uint32_t imageHeight, uint32_t mipLevels,
+                         VkFormat format, VkImageUsageFlags usage, VkImageAspectFlags aspectMask)
+{
+    Image result;
+
+    VkImageCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    createInfo.imageType = VK_IMAGE_TYPE_2D;
+    createInfo.format = format;
+    createInfo.extent = { imageWidth, imageHeight, 1 };
+    createInfo.mipLevels = mipLevels;
+    createInfo.arrayLayers = 1;
+    createInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    createInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    createInfo.usage = usage;
+    createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    createInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    VkImage image = 0;
+    VK_CHECK(vkCreateImage(device, &createInfo, 0, &image));
+    result.image = makeUnique(device, image, vkDestroyImage);
+
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(device, image, &requirements);
+
+    uint32_t memoryTypeIndex = findMemoryType(memoryProperties, requirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    result.memory = allocateTrackedMemory(device, requirements.size, memoryTypeIndex, getImageMemoryCategory(usage));
+
+    VK_CHECK(vkBindImageMemory(device, image, result.memory, 0));
+
+    result.view = makeUnique(device, createSubresourceView(device, image, format, aspectMask, 0, mipLevels), vkDestroyImageView);
+    result.format = format;
+    result.mipLevels = mipLevels;
+
+    return result;
+}
+
+//Frames in flight may still use the image, its handles are destroyed once retireValue has retired.
+//Until then the tracker knows the memory is on its way out.
+inline void retireImage(DeletionQueue& deletionQueue, uint64_t retireValue, Image& image)
+{
+    if (image.memory)
+    {
+        getMemoryTracker().trackPendingFree(image.memory);
+    }
+
+    deletionQueue.push(retireValue, std::move(image.view));
+    deletionQueue.push(retireValue, std::move(image.image));
+    deletionQueue.push(retireValue, std::move(image.memory));
+
+    image = Image();
+}
+
+inline VkImageMemoryBarrier imageBarrier(VkImage image, VkAccessFlags srcAccessMask, VkAccessFlags dstAccessMask, VkImageLayout oldLayout, VkImageLayout newLayout,
+                                         VkImageAspectFlags aspectMask = VK_IMAGE_ASPECT_COLOR_BIT, uint32_t baseMipLevel = 0, uint32_t levelCount = VK_REMAINING_MIP_LEVELS)
+{
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = srcAccessMask;
+    barrier.dstAccessMask = dstAccessMask;
+    barrier.oldLayout = oldLayout;
+    barrier.newLayout = newLayout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange.aspectMask = aspectMask;
+    barrier.subresourceRange.baseMipLevel = baseMipLevel;
+    barrier.subresourceRange.levelCount = levelCount;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+
+    return barrier;
+}
+
+inline VkBufferMemoryBarrier bufferBarrier(VkBuffer buffer, VkAccessFlags srcAccessMask, VkAccessFlags dstAccessMask)
+{
+    VkBufferMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = srcAccessMask;
+    barrier.dstAccessMask = dstAccessMask;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.buffer = buffer;
+    barrier.offset = 0;
+    barrier.size = VK_WHOLE_SIZE;
+
+    return barrier;
+}
@@ -0,0 +1,22 @@
+@echo off
+rem Compiles every Shaders\*.glsl to SPIR-V next to the source, same as compileshaders.sh
+rem Stage comes from the middle extension, triangle.vert.glsl -> vert -> triangle.vert.spv
+rem Uses GLSLANG_VALIDATOR when set, otherwise the one from the Vulkan SDK
+setlocal enabledelayedexpansion
+
+if "%GLSLANG_VALIDATOR%"=="" set "GLSLANG_VALIDATOR=%VULKAN_SDK%\Bin\glslangValidator.exe"
+
+if not exist "%GLSLANG_VALIDATOR%" (
+    echo compileshaders : glslangValidator not found, install the Vulkan SDK or set GLSLANG_VALIDATOR 1>&2
+    exit /b 1
+)
+
+set FAILED=0
+
+for %%f in ("%~dp0*.glsl") do (
+    for %%s in ("%%~nf") do set STAGE=%%~xs
+    "%GLSLANG_VALIDATOR%" -V --target-env vulkan1.1 -S !STAGE:~1! -o "%%~dpnf.spv" "%%~ff"
+    if errorlevel 1 set FAILED=1
+)
+
+exit /b %FAILED%
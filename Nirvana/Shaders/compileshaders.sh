@@ -0,0 +1,30 @@
+#!/bin/sh
+#Compiles every Shaders/*.glsl to SPIR-V next to the source, same as compileshaders.bat
+#Stage comes from the middle extension, triangle.vert.glsl -> vert -> triangle.vert.spv
+#Uses GLSLANG_VALIDATOR when set, otherwise the Vulkan SDK one, otherwise the one on PATH
+
+shaderDir=$(cd "$(dirname "$0")" && pwd)
+
+if [ -z "$GLSLANG_VALIDATOR" ]; then
+    if [ -n "$VULKAN_SDK" ]; then
+        GLSLANG_VALIDATOR="$VULKAN_SDK/bin/glslangValidator"
+    else
+        GLSLANG_VALIDATOR=glslangValidator
+    fi
+fi
+
+if ! command -v "$GLSLANG_VALIDATOR" > /dev/null 2>&1; then
+    echo "compileshaders : glslangValidator not found, install the Vulkan SDK or set GLSLANG_VALIDATOR" >&2
+    exit 1
+fi
+
+status=0
+
+for source in "$shaderDir"/*.glsl; do
+    name=${source%.glsl}
+    stage=${name##*.}
+
+    "$GLSLANG_VALIDATOR" -V --target-env vulkan1.1 -S "$stage" -o "$name.spv" "$source" || status=1
+done
+
+exit $status
@@ -0,0 +1,34 @@
+#version 450
+
+layout(local_size_x = 16, local_size_y = 16) in;
+
+layout(binding = 0, r32f) uniform writeonly image2D outImage;
+layout(binding = 1) uniform sampler2D inImage;
+
+layout(push_constant) uniform Reduce
+{
+  ivec2 inSize;
+  ivec2 outSize;
+};
+
+void main()
+{
+ ivec2 pos = ivec2(gl_GlobalInvocationID.xy);
+
+ if (pos.x >= outSize.x || pos.y >= outSize.y)
+  return;
+
+ //Level 0 is previous power of two of the depth buffer so footprint is not always exactly 2x2
+ vec2 scale = vec2(inSize) / vec2(outSize);
+ ivec2 begin = ivec2(floor(vec2(pos) * scale));
+ ivec2 end = min(ivec2(ceil(vec2(pos + 1) * scale)), inSize);
+
+ //Reverse Z so farthest depth is the smallest value, keep it to stay conservative
+ float depth = 1.0;
+
+ for (int y = begin.y; y < end.y; ++y)
+  for (int x = begin.x; x < end.x; ++x)
+   depth = min(depth, texelFetch(inImage, ivec2(x, y), 0).x);
+
+ imageStore(outImage, pos, vec4(depth));
+}
@@ -0,0 +1,261 @@
+#version 450
+
+layout(local_size_x = 64) in;
+
+//Permutations, see Permutations.h
+layout(constant_id = 0) const bool LATE = false;
+layout(constant_id = 1) const bool OCCLUSION = false;
+
+struct ObjectData
+{
+  vec4 sphere; //xyz center in view space, w radius
+};
+
+struct DrawCommand
+{
+  uint indexCount;
+  uint instanceCount;
+  uint firstIndex;
+  int vertexOffset;
+  uint firstInstance;
+};
+
+struct MeshLod
+{
+  uint indexOffset;
+  uint indexCount;
+  uint meshletOffset;
+  uint meshletCount;
+  float error; //In mesh units, mesh is unit sized so object radius scales it
+};
+
+//Triangles of a meshlet are a contiguous range of the index buffer, triangleOffset / 3 is the first triangle
+struct Meshlet
+{
+  vec4 sphere; //xyz center, w radius in mesh units
+  vec4 cone; //xyz axis, w cutoff
+  uint vertexOffset;
+  uint triangleOffset;
+  uint vertexCount;
+  uint triangleCount;
+};
+
+layout(binding = 0) readonly buffer Objects
+{
+  ObjectData objects[];
+};
+
+//objectCount early object draws, objectCount late object draws, then meshletCapacity early and meshletCapacity late meshlet draws
+layout(binding = 1) writeonly buffer Draws
+{
+  DrawCommand draws[];
+};
+
+//1 if object was drawn in early pass of this frame
+layout(binding = 2) buffer Visibility
+{
+  uint visibility[];
+};
+
+layout(binding = 3) buffer Stats
+{
+  uint visibleCount;
+  uint frustumCulledCount;
+  uint occludedCount;
+  uint triangleCount;
+  uint meshletCulledCount;
+  uint meshletSlots[2]; //Meshlet draws reserved by each pass
+};
+
+layout(binding = 4) uniform sampler2D depthPyramid;
+
+layout(binding = 5) readonly buffer Lods
+{
+  MeshLod lods[];
+};
+
+layout(binding = 6) readonly buffer Meshlets
+{
+  Meshlet meshlets[];
+};
+
+layout(push_constant) uniform CullData
+{
+  vec4 frustum; //Normalized x/z of left-right plane and y/z of top-bottom plane
+  float P00;
+  float P11;
+  float znear;
+  float pyramidWidth;
+  float pyramidHeight;
+  uint objectCount;
+  uint lodCount;
+  float lodTarget; //Error allowed per unit of distance, 1 pixel at current resolution
+  uint meshletCapacity; //Meshlet draw slots per pass
+};
+
+bool frustumTest(vec3 center, float radius)
+{
+ bool visible = center.z * frustum.y - abs(center.x) * frustum.x > -radius;
+ visible = visible && center.z * frustum.w - abs(center.y) * frustum.z > -radius;
+ visible = visible && center.z + radius > znear;
+ return visible;
+}
+
+//2D Polyhedral Bounds of a Clipped, Perspective-Projected 3D Sphere. Michael Mara, Morgan McGuire. 2013
+bool projectSphere(vec3 c, float r, out vec4 aabb)
+{
+ if (c.z < r + znear)
+  return false;
+
+ vec2 cx = -c.xz;
+ vec2 vx = vec2(sqrt(dot(cx, cx) - r * r), r);
+ vec2 minx = mat2(vx.x, vx.y, -vx.y, vx.x) * cx;
+ vec2 maxx = mat2(vx.x, -vx.y, vx.y, vx.x) * cx;
+
+ vec2 cy = -c.yz;
+ vec2 vy = vec2(sqrt(dot(cy, cy) - r * r), r);
+ vec2 miny = mat2(vy.x, vy.y, -vy.y, vy.x) * cy;
+ vec2 maxy = mat2(vy.x, -vy.y, vy.y, vy.x) * cy;
+
+ aabb = vec4(minx.x / minx.y * P00, miny.x / miny.y * P11, maxx.x / maxx.y * P00, maxy.x / maxy.y * P11);
+ aabb = aabb.xwzy * vec4(0.5, -0.5, 0.5, -0.5) + vec4(0.5); //Clip space to uv, viewport is flipped
+
+ return true;
+}
+
+bool occlusionTest(vec3 center, float radius)
+{
+ vec4 aabb;
+ if (!projectSphere(center, radius, aabb))
+  return true; //Intersects near plane, can not be occluded
+
+ float width = (aabb.z - aabb.x) * pyramidWidth;
+ float height = (aabb.w - aabb.y) * pyramidHeight;
+
+ //Pick the level where the rect covers at most 2x2 texels and sample all four corners
+ float level = ceil(log2(max(max(width, height), 1.0)));
+
+ float depth = textureLod(depthPyramid, aabb.xy, level).x;
+ depth = min(depth, textureLod(depthPyramid, aabb.zy, level).x);
+ depth = min(depth, textureLod(depthPyramid, aabb.xw, level).x);
+ depth = min(depth, textureLod(depthPyramid, aabb.zw, level).x);
+
+ //Reverse Z, nearest point of the sphere
+ float depthSphere = znear / (center.z - radius);
+
+ return depthSphere > depth;
+}
+
+//Coarsest LOD whose error projects to less than lodTarget
+uint selectLod(vec3 center, float radius)
+{
+ float distance = max(length(center) - radius, znear);
+
+ uint lodIndex = 0;
+ for (uint i = 1; i < lodCount; ++i)
+  if (lods[i].error * radius <= distance * lodTarget)
+   lodIndex = i;
+
+ return lodIndex;
+}
+
+//Camera sits at the origin of view space, cluster is backfacing when every normal in its cone points away from it
+bool coneTest(vec3 center, float radius, vec3 axis, float cutoff)
+{
+ return dot(center, axis) < cutoff * length(center) + radius;
+}
+
+//Writes one draw per meshlet of a visible object, culled meshlets get zero instances. False if the pass ran out of slots
+bool emitMeshletDraws(uint di, vec3 center, float radius, MeshLod lod)
+{
+ uint pass = LATE ? 1 : 0;
+ uint first = atomicAdd(meshletSlots[pass], lod.meshletCount);
+
+ if (first + lod.meshletCount > meshletCapacity)
+  return false;
+
+ uint drawBase = 2 * objectCount + pass * meshletCapacity + first;
+ uint triangles = 0;
+ uint culled = 0;
+
+ for (uint i = 0; i < lod.meshletCount; ++i)
+ {
+  Meshlet meshlet = meshlets[lod.meshletOffset + i];
+
+  //Object is only translated and uniformly scaled, the cone axis carries over unchanged
+  vec3 meshletCenter = center + meshlet.sphere.xyz * radius;
+  float meshletRadius = meshlet.sphere.w * radius;
+
+  bool visible = frustumTest(meshletCenter, meshletRadius) && coneTest(meshletCenter, meshletRadius, meshlet.cone.xyz, meshlet.cone.w);
+
+  if (visible)
+   triangles += meshlet.triangleCount;
+  else
+   culled++;
+
+  draws[drawBase + i].indexCount = meshlet.triangleCount * 3;
+  draws[drawBase + i].instanceCount = visible ? 1 : 0;
+  draws[drawBase + i].firstIndex = meshlet.triangleOffset;
+  draws[drawBase + i].vertexOffset = 0;
+  draws[drawBase + i].firstInstance = di;
+ }
+
+ atomicAdd(triangleCount, triangles);
+ atomicAdd(meshletCulledCount, culled);
+
+ return true;
+}
+
+void main()
+{
+ uint di = gl_GlobalInvocationID.x;
+
+ if (di >= objectCount)
+  return;
+
+ vec3 center = objects[di].sphere.xyz;
+ float radius = objects[di].sphere.w;
+
+ bool inFrustum = frustumTest(center, radius);
+ bool visible = false;
+
+ if (!LATE)
+ {
+  //Test against pyramid built from previous frame
+  visible = inFrustum && (!OCCLUSION || occlusionTest(center, radius));
+
+  visibility[di] = visible ? 1 : 0;
+
+  if (visible)
+   atomicAdd(visibleCount, 1);
+  else if (!inFrustum)
+   atomicAdd(frustumCulledCount, 1);
+ }
+ else
+ {
+  //Objects rejected early are re-tested against this frame's depth so disoccluded objects do not pop
+  bool drawnEarly = visibility[di] != 0;
+  visible = !drawnEarly && inFrustum && (!OCCLUSION || occlusionTest(center, radius));
+
+  if (visible)
+   atomicAdd(visibleCount, 1);
+  else if (!drawnEarly && inFrustum)
+   atomicAdd(occludedCount, 1);
+ }
+
+ MeshLod lod = lods[selectLod(center, radius)];
+
+ //Split visible objects into meshlets so backfacing and off screen clusters are skipped, whole LOD draw when out of slots
+ bool drawMeshlets = visible && lod.meshletCount > 1 && emitMeshletDraws(di, center, radius, lod);
+
+ if (visible && !drawMeshlets)
+  atomicAdd(triangleCount, lod.indexCount / 3);
+
+ uint drawIndex = LATE ? objectCount + di : di;
+
+ draws[drawIndex].indexCount = lod.indexCount;
+ draws[drawIndex].instanceCount = (visible && !drawMeshlets) ? 1 : 0;
+ draws[drawIndex].firstIndex = lod.indexOffset;
+ draws[drawIndex].vertexOffset = 0;
+ draws[drawIndex].firstInstance = di;
+}
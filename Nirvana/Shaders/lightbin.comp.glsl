@@ -0,0 +1,246 @@
+#version 450
+
+//Slice cull : one thread per light, appends it to the list of every depth slice its sphere reaches
+//Bin : one workgroup per cluster, threads stride over the list of the cluster's slice
+layout(local_size_x = 64) in;
+
+//Permutations, see ClusteredLighting.h
+layout(constant_id = 0) const bool SLICE_CULL = false;
+
+//Matches maxLightsPerCluster and clusterSlices in ClusteredLighting.h
+#define MAX_LIGHTS_PER_CLUSTER 256
+#define CLUSTER_SLICES 24
+
+struct Light
+{
+  vec3 position; //View space
+  float radius;
+  vec3 color;
+  float spotCosOuter; //-2 for point lights
+  vec3 direction;
+  float spotCosInner;
+};
+
+layout(binding = 0) uniform ClusterGrid
+{
+  float P00;
+  float P11;
+  float znear;
+  float zfar;
+  uint tilesX;
+  uint tilesY;
+  uint slices;
+  uint lightCount;
+  float tileWidth;
+  float tileHeight;
+  float sliceScale;
+  float sliceBias;
+};
+
+layout(binding = 1) readonly buffer Lights
+{
+  Light lights[];
+};
+
+//Offset and count into lightIndices
+layout(binding = 2) writeonly buffer Clusters
+{
+  uvec2 clusters[];
+};
+
+layout(binding = 3) writeonly buffer LightIndices
+{
+  uint lightIndices[];
+};
+
+//Cleared before the slice cull
+layout(binding = 4) buffer LightCounters
+{
+  uint indexCount;
+  uint droppedLightCount; //Lights a cluster reached but could not keep, read back for the stats
+  uint truncatedClusterCount;
+  uint sliceLightCounts[CLUSTER_SLICES];
+};
+
+//lightCount entries per slice, a light lands at most once in each so a slice never overflows
+layout(binding = 5) buffer SliceLights
+{
+  uint sliceLights[];
+};
+
+shared uint clusterLights[MAX_LIGHTS_PER_CLUSTER];
+shared uint clusterLightCount;
+shared uint clusterOffset;
+
+//Slice s covers view depth znear * (zfar / znear)^(s / slices) to the next one
+float sliceDepth(uint slice)
+{
+ return znear * pow(zfar / znear, float(slice) / float(slices));
+}
+
+//Conservative : tests the bounding sphere of the cluster, so cones that pass close to a corner are kept
+bool coneIntersectsSphere(Light light, vec3 center, float radius)
+{
+ vec3 v = center - light.position;
+ float lengthSq = dot(v, v);
+ float along = dot(v, light.direction);
+ float sinOuter = sqrt(max(1.0 - light.spotCosOuter * light.spotCosOuter, 0.0));
+ float distanceToCone = light.spotCosOuter * sqrt(max(lengthSq - along * along, 0.0)) - along * sinOuter;
+
+ bool angleCull = distanceToCone > radius;
+ bool frontCull = along > radius + light.radius;
+ bool backCull = along < -radius;
+
+ return !(angleCull || frontCull || backCull);
+}
+
+//Slice of a view depth, same mapping as the fragment shader
+uint depthSlice(float z)
+{
+ return uint(clamp(log(z) * sliceScale + sliceBias, 0.0, float(slices - 1)));
+}
+
+void cullLight()
+{
+ uint i = gl_GlobalInvocationID.x;
+
+ if (i >= lightCount)
+ {
+  return;
+ }
+
+ Light light = lights[i];
+ vec3 p = light.position;
+ float r = light.radius;
+
+ //Side planes go through the eye, x * P00 <= z is inside, the sphere is enough for spots too
+ vec2 nx = normalize(vec2(P00, -1.0));
+ vec2 ny = normalize(vec2(P11, -1.0));
+
+ bool visible = p.z + r >= znear && p.z - r <= zfar;
+ visible = visible && abs(p.x) * nx.x + p.z * nx.y <= r;
+ visible = visible && abs(p.y) * ny.x + p.z * ny.y <= r;
+
+ if (!visible)
+ {
+  return;
+ }
+
+ uint first = depthSlice(max(p.z - r, znear));
+ uint last = depthSlice(min(p.z + r, zfar));
+
+ for (uint slice = first; slice <= last; slice++)
+ {
+  uint slot = atomicAdd(sliceLightCounts[slice], 1);
+  sliceLights[slice * lightCount + slot] = i;
+ }
+}
+
+void binCluster()
+{
+ uvec3 cluster = gl_WorkGroupID;
+ uint clusterIndex = cluster.x + tilesX * (cluster.y + tilesY * cluster.z);
+
+ if (gl_LocalInvocationIndex == 0)
+ {
+  clusterLightCount = 0;
+ }
+
+ //Tile bounds in NDC, tile rows go down from the top of the screen because the viewport is flipped
+ vec2 ndcMin = vec2(-1.0 + 2.0 * float(cluster.x) / float(tilesX), 1.0 - 2.0 * float(cluster.y + 1) / float(tilesY));
+ vec2 ndcMax = vec2(-1.0 + 2.0 * float(cluster.x + 1) / float(tilesX), 1.0 - 2.0 * float(cluster.y) / float(tilesY));
+
+ float zmin = sliceDepth(cluster.z);
+ float zmax = sliceDepth(cluster.z + 1);
+
+ //View space x = ndc.x * z / P00, the tile widens with depth so the bounds come from both slice planes
+ vec2 scale = vec2(1.0 / P00, 1.0 / P11);
+ vec2 nearMin = ndcMin * scale * zmin;
+ vec2 nearMax = ndcMax * scale * zmin;
+ vec2 farMin = ndcMin * scale * zmax;
+ vec2 farMax = ndcMax * scale * zmax;
+
+ vec3 aabbMin = vec3(min(nearMin, farMin), zmin);
+ vec3 aabbMax = vec3(max(nearMax, farMax), zmax);
+
+ vec3 center = (aabbMin + aabbMax) * 0.5;
+ float radius = length(aabbMax - center);
+
+ barrier();
+
+ //Only lights the slice cull kept for this depth slice
+ uint sliceCount = sliceLightCounts[cluster.z];
+ uint sliceBase = cluster.z * lightCount;
+
+ for (uint n = gl_LocalInvocationIndex; n < sliceCount; n += gl_WorkGroupSize.x)
+ {
+  uint i = sliceLights[sliceBase + n];
+  Light light = lights[i];
+
+  //Sphere against box, squared distance from the light to the closest point
+  vec3 closest = clamp(light.position, aabbMin, aabbMax);
+  vec3 delta = closest - light.position;
+
+  bool visible = dot(delta, delta) <= light.radius * light.radius;
+
+  if (visible && light.spotCosOuter > -1.0)
+  {
+   visible = coneIntersectsSphere(light, center, radius);
+  }
+
+  if (visible)
+  {
+   uint slot = atomicAdd(clusterLightCount, 1);
+
+   if (slot < MAX_LIGHTS_PER_CLUSTER)
+   {
+    clusterLights[slot] = i;
+   }
+  }
+ }
+
+ barrier();
+
+ //One global allocation per cluster keeps the lists compact
+ if (gl_LocalInvocationIndex == 0)
+ {
+  uint found = clusterLightCount;
+  uint count = min(found, MAX_LIGHTS_PER_CLUSTER);
+  uint offset = atomicAdd(indexCount, count);
+  uint capacity = lightIndices.length();
+
+  //Out of index space, keep what fits
+  count = offset < capacity ? min(count, capacity - offset) : 0;
+
+  //Past the cluster or index list capacity, counted so the clamp shows up in the stats
+  if (count < found)
+  {
+   atomicAdd(droppedLightCount, found - count);
+   atomicAdd(truncatedClusterCount, 1);
+  }
+
+  clusters[clusterIndex] = uvec2(offset, count);
+
+  clusterOffset = offset;
+  clusterLightCount = count;
+ }
+
+ barrier();
+
+ for (uint i = gl_LocalInvocationIndex; i < clusterLightCount; i += gl_WorkGroupSize.x)
+ {
+  lightIndices[clusterOffset + i] = clusterLights[i];
+ }
+}
+
+void main()
+{
+ if (SLICE_CULL)
+ {
+  cullLight();
+ }
+ else
+ {
+  binCluster();
+ }
+}
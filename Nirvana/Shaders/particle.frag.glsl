@@ -0,0 +1,15 @@
+#version 450
+
+layout(location = 0) in vec2 inUv;
+layout(location = 1) in float inFade;
+
+layout(location = 0) out vec4 outColor;
+
+void main()
+{
+ //Soft round sprite fading out over its life
+ float falloff = 1.0 - clamp(dot(inUv, inUv), 0.0, 1.0);
+ float alpha = falloff * falloff * inFade;
+
+ outColor = vec4(mix(vec3(1.0, 0.3, 0.05), vec3(1.0, 0.9, 0.4), inFade), alpha);
+}
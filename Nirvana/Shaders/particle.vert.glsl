@@ -0,0 +1,39 @@
+#version 450
+
+//Written by the last sort pass, back to front. firstInstance of the draw points at this frame's half
+layout(binding = 0) readonly buffer Positions
+{
+  vec4 positions[]; //xyz in view space, size
+};
+
+layout(binding = 1) readonly buffer Fades
+{
+  float fades[];
+};
+
+layout(push_constant) uniform Camera
+{
+  float P00;
+  float P11;
+  float znear;
+};
+
+layout(location = 0) out vec2 outUv;
+layout(location = 1) out float outFade;
+
+const vec2 corners[6] = vec2[](vec2(-1, -1), vec2(1, -1), vec2(1, 1), vec2(-1, -1), vec2(1, 1), vec2(-1, 1));
+
+void main()
+{
+ vec4 particle = positions[gl_InstanceIndex];
+
+ //Scene is in view space so a view aligned quad just offsets x and y
+ vec2 corner = corners[gl_VertexIndex];
+ vec3 position = particle.xyz + vec3(corner * particle.w, 0.0);
+
+ outUv = corner;
+ outFade = fades[gl_InstanceIndex];
+
+ //Reverse Z infinite perspective, see triangle.vert.glsl
+ gl_Position = vec4(position.x * P00, position.y * P11, znear, position.z);
+}
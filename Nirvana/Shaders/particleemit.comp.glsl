@@ -0,0 +1,92 @@
+#version 450
+
+layout(local_size_x = 64) in;
+
+layout(binding = 0) writeonly buffer Positions
+{
+  vec4 positions[]; //xyz, size
+};
+
+layout(binding = 1) writeonly buffer Velocities
+{
+  vec4 velocities[];
+};
+
+layout(binding = 2) writeonly buffer Lives
+{
+  vec2 lives[]; //age, lifetime
+};
+
+layout(binding = 3) readonly buffer DeadList
+{
+  uint deadList[];
+};
+
+layout(binding = 4) readonly buffer Counters
+{
+  uint emitDispatch[3];
+  uint simulateDispatch[3];
+  uint sortDispatch[3];
+  uint aliveCount;
+  uint deadCount;
+  uint emitCount;
+  uint newAliveCount;
+};
+
+//List simulate reads this frame
+layout(binding = 6) writeonly buffer AliveIn
+{
+  uint aliveIn[];
+};
+
+layout(push_constant) uniform Params
+{
+  vec3 emitterPosition;
+  float emitterRadius;
+  vec3 gravity;
+  float deltaTime;
+  float lifetime;
+  float speed;
+  float size;
+  uint emitRequest;
+  uint seed;
+  uint radixShift;
+  uint maxParticles; //Current capacity, lower than ParticleSystem::maxParticles while evicted
+  uint drawSet; //Frame in flight whose draw data this update writes
+};
+
+//PCG hash, Jarzynski and Olano 2020
+uint hash(uint v)
+{
+ uint state = v * 747796405u + 2891336453u;
+ uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+ return (word >> 22u) ^ word;
+}
+
+float random(inout uint state)
+{
+ state = hash(state);
+ return float(state) / 4294967295.0;
+}
+
+void main()
+{
+ uint i = gl_GlobalInvocationID.x;
+
+ if (i >= emitCount)
+  return;
+
+ //Prepare already moved the counts, popped slots sit right above deadCount
+ uint slot = deadList[deadCount + i];
+
+ uint state = hash(seed ^ hash(i));
+
+ vec3 offset = vec3(random(state), random(state), random(state)) * 2.0 - 1.0;
+ vec3 direction = normalize(vec3(offset.x * 0.3, 1.0, offset.z * 0.3));
+
+ positions[slot] = vec4(emitterPosition + offset * emitterRadius, size);
+ velocities[slot] = vec4(direction * speed * (0.75 + 0.5 * random(state)), 0.0);
+ lives[slot] = vec2(0.0, lifetime * (0.5 + 0.5 * random(state)));
+
+ aliveIn[aliveCount - emitCount + i] = slot;
+}
@@ -0,0 +1,52 @@
+#version 450
+
+layout(local_size_x = 64) in;
+
+layout(binding = 3) writeonly buffer DeadList
+{
+  uint deadList[];
+};
+
+layout(binding = 4) buffer Counters
+{
+  uint emitDispatch[3];
+  uint simulateDispatch[3];
+  uint sortDispatch[3];
+  uint aliveCount;
+  uint deadCount;
+  uint emitCount;
+  uint newAliveCount;
+};
+
+layout(push_constant) uniform Params
+{
+  vec3 emitterPosition;
+  float emitterRadius;
+  vec3 gravity;
+  float deltaTime;
+  float lifetime;
+  float speed;
+  float size;
+  uint emitRequest;
+  uint seed;
+  uint radixShift;
+  uint maxParticles; //Current capacity, lower than ParticleSystem::maxParticles while evicted
+  uint drawSet; //Frame in flight whose draw data this update writes
+};
+
+//Every slot dead, runs before the first update on new buffers so nothing has to be uploaded
+void main()
+{
+ uint i = gl_GlobalInvocationID.x;
+
+ if (i == 0)
+ {
+  aliveCount = 0;
+  deadCount = maxParticles;
+  emitCount = 0;
+  newAliveCount = 0;
+ }
+
+ if (i < maxParticles)
+  deadList[i] = i;
+}
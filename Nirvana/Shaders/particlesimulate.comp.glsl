@@ -0,0 +1,98 @@
+#version 450
+
+layout(local_size_x = 64) in;
+
+layout(binding = 0) buffer Positions
+{
+  vec4 positions[]; //xyz, size
+};
+
+layout(binding = 1) buffer Velocities
+{
+  vec4 velocities[];
+};
+
+layout(binding = 2) buffer Lives
+{
+  vec2 lives[]; //age, lifetime
+};
+
+layout(binding = 3) writeonly buffer DeadList
+{
+  uint deadList[];
+};
+
+layout(binding = 4) buffer Counters
+{
+  uint emitDispatch[3];
+  uint simulateDispatch[3];
+  uint sortDispatch[3];
+  uint aliveCount;
+  uint deadCount;
+  uint emitCount;
+  uint newAliveCount;
+};
+
+layout(binding = 6) readonly buffer AliveIn
+{
+  uint aliveIn[];
+};
+
+layout(binding = 7) writeonly buffer KeysOut
+{
+  uint keysOut[];
+};
+
+layout(binding = 8) writeonly buffer AliveOut
+{
+  uint aliveOut[];
+};
+
+layout(push_constant) uniform Params
+{
+  vec3 emitterPosition;
+  float emitterRadius;
+  vec3 gravity;
+  float deltaTime;
+  float lifetime;
+  float speed;
+  float size;
+  uint emitRequest;
+  uint seed;
+  uint radixShift;
+  uint maxParticles; //Current capacity, lower than ParticleSystem::maxParticles while evicted
+  uint drawSet; //Frame in flight whose draw data this update writes
+};
+
+void main()
+{
+ uint i = gl_GlobalInvocationID.x;
+
+ if (i >= aliveCount)
+  return;
+
+ uint slot = aliveIn[i];
+
+ vec2 life = lives[slot];
+ life.x += deltaTime;
+
+ if (life.x >= life.y)
+ {
+  deadList[atomicAdd(deadCount, 1)] = slot;
+  return;
+ }
+
+ vec3 velocity = velocities[slot].xyz + gravity * deltaTime;
+ vec3 position = positions[slot].xyz + velocity * deltaTime;
+
+ positions[slot].xyz = position;
+ velocities[slot].xyz = velocity;
+ lives[slot] = life;
+
+ //Compaction, survivors are packed into the other alive list
+ uint index = atomicAdd(newAliveCount, 1);
+ aliveOut[index] = slot;
+
+ //Positive floats order like their bits, inverted so the farthest sorts first, top 16 bits are plenty for blending order
+ keysOut[index] = ~floatBitsToUint(max(position.z, 0.0)) >> 16;
+}
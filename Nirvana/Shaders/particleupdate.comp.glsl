@@ -0,0 +1,85 @@
+#version 450
+
+layout(local_size_x = 1) in;
+
+//Permutations, see Particles.h
+layout(constant_id = 0) const bool FINALIZE = false;
+
+layout(binding = 4) buffer Counters
+{
+  uint emitDispatch[3];
+  uint simulateDispatch[3];
+  uint sortDispatch[3];
+  uint aliveCount;
+  uint deadCount;
+  uint emitCount;
+  uint newAliveCount;
+};
+
+struct DrawCommand
+{
+  uint vertexCount;
+  uint instanceCount;
+  uint firstVertex;
+  uint firstInstance;
+};
+
+//One per frame in flight
+layout(binding = 12) writeonly buffer DrawArgs
+{
+  DrawCommand drawArgs[];
+};
+
+layout(push_constant) uniform Params
+{
+  vec3 emitterPosition;
+  float emitterRadius;
+  vec3 gravity;
+  float deltaTime;
+  float lifetime;
+  float speed;
+  float size;
+  uint emitRequest;
+  uint seed;
+  uint radixShift;
+  uint maxParticles; //Current capacity, lower than ParticleSystem::maxParticles while evicted
+  uint drawSet; //Frame in flight whose draw data this update writes
+};
+
+//Single thread bookkeeping between passes so the CPU never needs to know the counts
+void main()
+{
+ if (!FINALIZE)
+ {
+  //Emit pops from the top of the dead list and appends to the end of the alive list
+  uint emit = min(emitRequest, deadCount);
+
+  emitCount = emit;
+  deadCount -= emit;
+  aliveCount += emit;
+  newAliveCount = 0;
+
+  emitDispatch[0] = (emit + 63) / 64;
+  emitDispatch[1] = 1;
+  emitDispatch[2] = 1;
+
+  simulateDispatch[0] = (aliveCount + 63) / 64;
+  simulateDispatch[1] = 1;
+  simulateDispatch[2] = 1;
+ }
+ else
+ {
+  //Survivors of simulate are the alive list of the next frame
+  aliveCount = newAliveCount;
+
+  sortDispatch[0] = (aliveCount + 1023) / 1024;
+  sortDispatch[1] = 1;
+  sortDispatch[2] = 1;
+
+  //firstInstance selects this frame's half of the draw data
+  drawArgs[drawSet].vertexCount = 6;
+  drawArgs[drawSet].instanceCount = aliveCount;
+  drawArgs[drawSet].firstVertex = 0;
+  drawArgs[drawSet].firstInstance = drawSet * maxParticles;
+ }
+}
@@ -0,0 +1,206 @@
+#version 450
+
+//256 threads, 4 keys each, one 8 bit digit per pass
+layout(local_size_x = 256) in;
+
+//Permutations, see Particles.h, neither set is the histogram count
+layout(constant_id = 0) const bool SCAN = false;
+layout(constant_id = 1) const bool SCATTER = false;
+layout(constant_id = 2) const bool DRAW_OUTPUT = false; //Last scatter pass, also writes the frame's draw data
+
+#define RADIX 256
+#define ITEMS 4
+#define BLOCK_SIZE (RADIX * ITEMS)
+
+layout(binding = 0) readonly buffer Positions
+{
+  vec4 positions[]; //xyz, size
+};
+
+layout(binding = 2) readonly buffer Lives
+{
+  vec2 lives[]; //age, lifetime
+};
+
+layout(binding = 4) readonly buffer Counters
+{
+  uint emitDispatch[3];
+  uint simulateDispatch[3];
+  uint sortDispatch[3];
+  uint aliveCount;
+  uint deadCount;
+  uint emitCount;
+  uint newAliveCount;
+};
+
+layout(binding = 5) readonly buffer KeysIn
+{
+  uint keysIn[];
+};
+
+layout(binding = 6) readonly buffer ValuesIn
+{
+  uint valuesIn[];
+};
+
+layout(binding = 7) writeonly buffer KeysOut
+{
+  uint keysOut[];
+};
+
+layout(binding = 8) writeonly buffer ValuesOut
+{
+  uint valuesOut[];
+};
+
+//Digit major : histograms[digit * blockCount + block], so one linear scan yields every block's output offset
+layout(binding = 9) buffer Histograms
+{
+  uint histograms[];
+};
+
+//Sorted copies of what particle.vert.glsl reads, drawSet * maxParticles is the first entry of this frame
+layout(binding = 10) writeonly buffer DrawPositions
+{
+  vec4 drawPositions[];
+};
+
+layout(binding = 11) writeonly buffer DrawFades
+{
+  float drawFades[];
+};
+
+layout(push_constant) uniform Params
+{
+  vec3 emitterPosition;
+  float emitterRadius;
+  vec3 gravity;
+  float deltaTime;
+  float lifetime;
+  float speed;
+  float size;
+  uint emitRequest;
+  uint seed;
+  uint radixShift;
+  uint maxParticles; //Current capacity, lower than ParticleSystem::maxParticles while evicted
+  uint drawSet; //Frame in flight whose draw data this update writes
+};
+
+shared uint digitCounts[RADIX];
+shared uint digits[RADIX];
+
+//Keys of a block are read in ITEMS rounds of RADIX consecutive keys, the same order scatter uses
+void countDigits(uint block, uint t, uint blockCount)
+{
+ digitCounts[t] = 0;
+ barrier();
+
+ for (uint i = 0; i < ITEMS; i++)
+ {
+  uint index = block * BLOCK_SIZE + i * RADIX + t;
+
+  if (index < aliveCount)
+   atomicAdd(digitCounts[(keysIn[index] >> radixShift) & (RADIX - 1)], 1);
+ }
+
+ barrier();
+
+ histograms[t * blockCount + block] = digitCounts[t];
+}
+
+//Single workgroup, thread t owns digit t and walks every block serially.
+//Cost grows linearly with blockCount, radixMaxBlocks in Particles.h caps it, more needs a hierarchical scan.
+void scanDigits(uint t, uint blockCount)
+{
+ uint sum = 0;
+ for (uint block = 0; block < blockCount; block++)
+ {
+  uint count = histograms[t * blockCount + block];
+  histograms[t * blockCount + block] = sum;
+  sum += count;
+ }
+
+ digitCounts[t] = sum;
+ barrier();
+
+ //256 totals, a serial scan is cheaper than the barriers of a parallel one
+ if (t == 0)
+ {
+  uint running = 0;
+  for (uint d = 0; d < RADIX; d++)
+  {
+   uint count = digitCounts[d];
+   digitCounts[d] = running;
+   running += count;
+  }
+ }
+
+ barrier();
+
+ uint base = digitCounts[t];
+ for (uint block = 0; block < blockCount; block++)
+  histograms[t * blockCount + block] += base;
+}
+
+//Stable, keys with equal digits keep their order which LSD radix sort relies on
+void scatterKeys(uint block, uint t, uint blockCount)
+{
+ digitCounts[t] = histograms[t * blockCount + block];
+
+ for (uint i = 0; i < ITEMS; i++)
+ {
+  uint index = block * BLOCK_SIZE + i * RADIX + t;
+  bool valid = index < aliveCount;
+
+  uint key = valid ? keysIn[index] : 0;
+  uint digit = valid ? (key >> radixShift) & (RADIX - 1) : RADIX; //Out of range never matches a real digit
+
+  digits[t] = digit;
+  barrier();
+
+  //Rank among earlier threads of this round with the same digit
+  uint rank = 0;
+  for (uint j = 0; j < t; j++)
+   rank += digits[j] == digit ? 1 : 0;
+
+  if (valid)
+  {
+   uint destination = digitCounts[digit] + rank;
+   uint slot = valuesIn[index];
+   keysOut[destination] = key;
+   valuesOut[destination] = slot;
+
+   //Copied rather than referenced by slot so the next update can simulate while this frame draws
+   if (DRAW_OUTPUT)
+   {
+    vec2 life = lives[slot];
+    drawPositions[drawSet * maxParticles + destination] = positions[slot];
+    drawFades[drawSet * maxParticles + destination] = 1.0 - life.x / life.y;
+   }
+  }
+
+  barrier();
+
+  //Advance offset of digit t past this round's keys
+  uint count = 0;
+  for (uint j = 0; j < RADIX; j++)
+   count += digits[j] == t ? 1 : 0;
+
+  digitCounts[t] += count;
+  barrier();
+ }
+}
+
+void main()
+{
+ uint block = gl_WorkGroupID.x;
+ uint t = gl_LocalInvocationID.x;
+ uint blockCount = (aliveCount + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+ if (SCAN)
+  scanDigits(t, blockCount);
+ else if (SCATTER)
+  scatterKeys(block, t, blockCount);
+ else
+  countDigits(block, t, blockCount);
+}
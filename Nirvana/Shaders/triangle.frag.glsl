@@ -1,8 +1,87 @@
 #version 450
 
+struct Light
+{
+  vec3 position; //View space
+  float radius;
+  vec3 color;
+  float spotCosOuter; //-2 for point lights
+  vec3 direction;
+  float spotCosInner;
+};
+
+//Lights, grid and lists are written by lightbin.comp.glsl, see ClusteredLighting.h
+layout(binding = 2) readonly buffer Lights
+{
+  Light lights[];
+};
+
+//Offset and count into lightIndices
+layout(binding = 3) readonly buffer Clusters
+{
+  uvec2 clusters[];
+};
+
+layout(binding = 4) readonly buffer LightIndices
+{
+  uint lightIndices[];
+};
+
+layout(binding = 5) uniform ClusterGrid
+{
+  float P00;
+  float P11;
+  float znear;
+  float zfar;
+  uint tilesX;
+  uint tilesY;
+  uint slices;
+  uint lightCount;
+  float tileWidth;
+  float tileHeight;
+  float sliceScale;
+  float sliceBias;
+};
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inNormal;
+
 layout(location = 0) out vec4 outColor;
 
+const vec3 albedo = vec3(0.8);
+const vec3 ambient = vec3(0.02);
+
 void main()
 {
- outColor = vec4(1.0f, 0.0f, 1.0f, 1.0);
-}
\ No newline at end of file
+ //Same froxel the binning pass built, depth slices are exponential in view z
+ uvec2 tile = min(uvec2(gl_FragCoord.xy / vec2(tileWidth, tileHeight)), uvec2(tilesX - 1, tilesY - 1));
+ uint slice = uint(clamp(log(inPosition.z) * sliceScale + sliceBias, 0.0, float(slices - 1)));
+
+ uvec2 cluster = clusters[tile.x + tilesX * (tile.y + tilesY * slice)];
+
+ vec3 normal = normalize(inNormal);
+ vec3 color = ambient * albedo;
+
+ for (uint i = 0; i < cluster.y; i++)
+ {
+  Light light = lights[lightIndices[cluster.x + i]];
+
+  vec3 toLight = light.position - inPosition;
+  float distanceSq = dot(toLight, toLight);
+  vec3 L = toLight * inversesqrt(max(distanceSq, 1e-8));
+
+  //Inverse square, windowed so it reaches zero at the radius the light was binned with
+  float ratio = distanceSq / (light.radius * light.radius);
+  float window = clamp(1.0 - ratio * ratio, 0.0, 1.0);
+  float attenuation = window * window / (distanceSq + 1.0);
+
+  if (light.spotCosOuter > -1.0)
+  {
+   attenuation *= smoothstep(light.spotCosOuter, light.spotCosInner, dot(-L, light.direction));
+  }
+
+  color += albedo * light.color * max(dot(normal, L), 0.0) * attenuation;
+ }
+
+ outColor = vec4(color, 1.0);
+}
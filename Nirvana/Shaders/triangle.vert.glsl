@@ -1,13 +1,51 @@
 #version 450
 
-const vec3 vertices [] = 
+struct ObjectData
 {
-  vec3(0, 0.5, 0),
-  vec3(0.5, -0.5, 0),
-  vec3(-0.5, -0.5, 0)
+  vec4 sphere; //xyz center in view space, w radius
 };
 
+//Scalars so the std430 stride matches the tightly packed C++ Vertex
+struct Vertex
+{
+  float px, py, pz;
+  float nx, ny, nz;
+};
+
+layout(binding = 0) readonly buffer Objects
+{
+  ObjectData objects[];
+};
+
+layout(binding = 1) readonly buffer Vertices
+{
+  Vertex vertices[];
+};
+
+layout(push_constant) uniform Camera
+{
+  float P00;
+  float P11;
+  float znear;
+};
+
+//View space, lighting in triangle.frag.glsl is done in view space as well
+layout(location = 0) out vec3 outPosition;
+layout(location = 1) out vec3 outNormal;
+
 void main()
 {
- gl_Position = vec4(vertices[gl_VertexIndex], 1.0);
-}
\ No newline at end of file
+ //Culling passes object index as firstInstance
+ ObjectData object = objects[gl_InstanceIndex];
+ Vertex vertex = vertices[gl_VertexIndex];
+
+ //Mesh is unit sized so radius doubles as scale
+ vec3 position = object.sphere.xyz + vec3(vertex.px, vertex.py, vertex.pz) * object.sphere.w;
+
+ //Reverse Z infinite perspective, depth = znear / z
+ gl_Position = vec4(position.x * P00, position.y * P11, znear, position.z);
+
+ //Uniform scale, normal needs no inverse transpose
+ outPosition = position;
+ outNormal = vec3(vertex.nx, vertex.ny, vertex.nz);
+}
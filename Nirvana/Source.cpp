@@ -6,15 +6,20 @@
 #include <optional>
 #include <vector>
 #include <set>
+#include <random>
+#include <math.h>
+#include <string.h>
 #include <GLFW/glfw3.h>
 #include <GLFW/glfw3native.h>
 #include <vulkan/vulkan.h>
-
-#define VK_CHECK(call) \
-do {\
- VkResult result = call; \
-assert(result == VK_SUCCESS); \
-} while(0);\
+#include "Common.h"
+#include "Handles.h"
+#include "DeletionQueue.h"
+#include "OcclusionCulling.h"
+#include "MeshCache.h"
+#include "Submission.h"
+#include "Particles.h"
+#include "ClusteredLighting.h"
 
 const char *debugLayers[] =
 {
@@ -26,13 +31,18 @@ const char *deviceExtension[] =
     VK_KHR_SWAPCHAIN_EXTENSION_NAME
 };
 
+//Initial window size, the window is resizable and render targets follow the swapchain extent
 constexpr uint32_t width = 1024;
 constexpr uint32_t height = 768;
 
+//Number of frames CPU is allowed to record ahead of GPU before waiting on a fence
+constexpr uint32_t maxFramesInFlight = 2;
+
 typedef struct QueueIndexFamily
 {
     std::optional<uint32_t> graphicsFamily;
     std::optional<uint32_t> presentFamily;
+    std::optional<uint32_t> computeFamily; //Dedicated async compute family when there is one, graphics family otherwise
 
     bool isComplete()
     {
@@ -173,10 +183,27 @@ QueueIndexFamily getQueueFamilyIndices(VkPhysicalDevice device, VkSurfaceKHR sur
         i++;
     }
 
+    //Compute only families run alongside graphics instead of queueing behind it
+    for (uint32_t family = 0; family < queueFamilyPropCount; family++)
+    {
+        const VkQueueFamilyProperties& q = qProps[family];
+
+        if (q.queueCount > 0 && (q.queueFlags & VK_QUEUE_COMPUTE_BIT) && !(q.queueFlags & VK_QUEUE_GRAPHICS_BIT))
+        {
+            indices.computeFamily = family;
+            break;
+        }
+    }
+
+    if (!indices.computeFamily.has_value())
+    {
+        indices.computeFamily = indices.graphicsFamily;
+    }
+
     return indices;
 }
 
-bool requiredDeviceExtensionSupported(VkPhysicalDevice device)
+bool isDeviceExtensionSupported(VkPhysicalDevice device, const char* extensionName)
 {
     uint32_t extensionCount = 0;
     vkEnumerateDeviceExtensionProperties(device, 0, &extensionCount, 0);
@@ -186,13 +213,18 @@ bool requiredDeviceExtensionSupported(VkPhysicalDevice device)
 
     for (const auto& prop :  props)
     {
-        if (strcmp(prop.extensionName, deviceExtension[0]) == 0)
+        if (strcmp(prop.extensionName, extensionName) == 0)
             return true;
     }
 
     return false;
 }
 
+bool requiredDeviceExtensionSupported(VkPhysicalDevice device)
+{
+    return isDeviceExtensionSupported(device, deviceExtension[0]);
+}
+
 SwapChainDetails getSurfaceCompatibility(VkPhysicalDevice device, VkSurfaceKHR surface)
 {
     SwapChainDetails details;
@@ -251,10 +283,11 @@ VkPhysicalDevice pickPhysicalDevice(VkInstance instance, VkSurfaceKHR surface, Q
     return VK_NULL_HANDLE;
 }
 
-VkDevice createLogicalDevice(VkPhysicalDevice device, VkSurfaceKHR surface,  QueueIndexFamily indices)
+//Optional extensions are enabled when the device has them, callers check for them the same way
+VkDevice createLogicalDevice(VkPhysicalDevice device, VkSurfaceKHR surface,  QueueIndexFamily indices, bool memoryBudget)
 {
     //device can create multiple qs instance here it will create two qs one for present and other for graphics
-    std::set<uint32_t> uniqueIndices = {indices.graphicsFamily.value(), indices.presentFamily.value()};
+    std::set<uint32_t> uniqueIndices = {indices.graphicsFamily.value(), indices.presentFamily.value(), indices.computeFamily.value()};
     std::vector<VkDeviceQueueCreateInfo> qCreateInfo = {};
 
     float qPriority = 1.0f;
@@ -273,6 +306,8 @@ VkDevice createLogicalDevice(VkPhysicalDevice device, VkSurfaceKHR surface,  Que
     }
 
     VkPhysicalDeviceFeatures    pDeviceFeatures = {};
+    pDeviceFeatures.multiDrawIndirect = VK_TRUE; //Culling emits one indirect draw per object
+    pDeviceFeatures.drawIndirectFirstInstance = VK_TRUE; //firstInstance carries the object index
     VkDeviceCreateInfo createInfo = {};
 
     createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -284,8 +319,15 @@ VkDevice createLogicalDevice(VkPhysicalDevice device, VkSurfaceKHR surface,  Que
     createInfo.ppEnabledLayerNames = debugLayers;
     createInfo.enabledLayerCount = sizeof(debugLayers) / sizeof(debugLayers[0]);
 #endif
-    createInfo.ppEnabledExtensionNames = deviceExtension;
-    createInfo.enabledExtensionCount = sizeof(deviceExtension) / sizeof(deviceExtension[0]);
+
+    std::vector<const char*> extensions(deviceExtension, deviceExtension + sizeof(deviceExtension) / sizeof(deviceExtension[0]));
+    if (memoryBudget)
+    {
+        extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    }
+
+    createInfo.ppEnabledExtensionNames = extensions.data();
+    createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
     createInfo.pEnabledFeatures = &pDeviceFeatures;
 
     VkDevice logicalDevice;
@@ -334,12 +376,30 @@ VkPresentModeKHR chooseSwapPresentMode(const std::vector<VkPresentModeKHR> avail
     return bestMode;
 }
 
+//Surface reports its size unless the window system lets the swapchain pick it, then it follows the window's framebuffer
+VkExtent2D chooseSwapExtent(const VkSurfaceCapabilitiesKHR& capabilities, GLFWwindow* window)
+{
+    if (capabilities.currentExtent.width != std::numeric_limits<uint32_t>::max())
+    {
+        return capabilities.currentExtent;
+    }
+
+    int framebufferWidth = 0, framebufferHeight = 0;
+    glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+
+    VkExtent2D extent = { static_cast<uint32_t>(framebufferWidth), static_cast<uint32_t>(framebufferHeight) };
+    extent.width = std::clamp(extent.width, capabilities.minImageExtent.width, capabilities.maxImageExtent.width);
+    extent.height = std::clamp(extent.height, capabilities.minImageExtent.height, capabilities.maxImageExtent.height);
+
+    return extent;
+}
+
 //ToDo: Cleanup
-VkSwapchainKHR createSwapchain(VkDevice device, VkPhysicalDevice pDevice, VkSurfaceKHR surface, QueueIndexFamily indices, SwapChainDetails details)
+//oldSwapchain is the one being replaced, or VK_NULL_HANDLE for the first one
+VkSwapchainKHR createSwapchain(VkDevice device, VkPhysicalDevice pDevice, VkSurfaceKHR surface, QueueIndexFamily indices, SwapChainDetails details, VkExtent2D extents, VkSwapchainKHR oldSwapchain)
 {
     VkSurfaceFormatKHR imageFormat = chooseSwapChainSurfaceFormat(details.formats);
     VkPresentModeKHR presentMode = chooseSwapPresentMode(details.presentModes);
-    VkExtent2D extents = { width, height };
 
     uint32_t imageCount = details.capabilities.minImageCount + 1;
 
@@ -379,7 +439,7 @@ VkSwapchainKHR createSwapchain(VkDevice device, VkPhysicalDevice pDevice, VkSurf
     createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
     createInfo.presentMode = presentMode; 
     createInfo.clipped = VK_TRUE;
-    createInfo.oldSwapchain = VK_NULL_HANDLE;
+    createInfo.oldSwapchain = oldSwapchain;
 
     VK_CHECK(vkCreateSwapchainKHR(device, &createInfo, 0, &swapChain));
 
@@ -396,12 +456,23 @@ VkSemaphore createSemaphore(VkDevice device)
     return semaphore;
 }
 
-VkCommandPool createCommandPool(VkDevice device, VkPhysicalDevice pDevice, VkSurfaceKHR surface, QueueIndexFamily indices)
+VkFence createFence(VkDevice device)
+{
+    VkFence fence = 0;
+    VkFenceCreateInfo createInfo = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
+    createInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT; //First wait on a frame slot must not block
+
+    VK_CHECK(vkCreateFence(device, &createInfo, 0, &fence));
+
+    return fence;
+}
+
+VkCommandPool createCommandPool(VkDevice device, uint32_t queueFamilyIndex)
 {
     VkCommandPoolCreateInfo createInfo = {};
     createInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
     createInfo.flags = 0;
-    createInfo.queueFamilyIndex = indices.graphicsFamily.value();
+    createInfo.queueFamilyIndex = queueFamilyIndex;
 
     VkCommandPool commandPool;
     VK_CHECK(vkCreateCommandPool(device, &createInfo, 0, &commandPool));
@@ -445,27 +516,51 @@ VkCommandBuffer createCommandBuffer(VkDevice device, VkCommandPool pool)
     return cmdBuffer;
 }
 
-VkRenderPass createRenderPass(VkDevice device, SwapChainDetails details)
+//Early pass clears and leaves attachments for the late pass, late pass loads them and transitions color for present
+VkRenderPass createRenderPass(VkDevice device, SwapChainDetails details, VkFormat depthFormat, bool late)
 {
     VkRenderPass renderPass;
 
-    VkAttachmentDescription attachment[1]; //Hack : Currently we only have color attachment
+    VkAttachmentDescription attachment[2];
     attachment[0].flags = 0;
     attachment[0].format = chooseSwapChainSurfaceFormat(details.formats).format;
     attachment[0].samples = VK_SAMPLE_COUNT_1_BIT;
-    attachment[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attachment[0].loadOp = late ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
     attachment[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
     attachment[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     attachment[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    attachment[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED; //Initialy I gave it as color optimial that raised validation layer error
-    attachment[0].finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    attachment[0].initialLayout = late ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED; //Initialy I gave it as color optimial that raised validation layer error
+    attachment[0].finalLayout = late ? VK_IMAGE_LAYOUT_PRESENT_SRC_KHR : VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    //Depth is sampled by the pyramid pass in between, barriers for that are recorded outside the render pass
+    attachment[1].flags = 0;
+    attachment[1].format = depthFormat;
+    attachment[1].samples = VK_SAMPLE_COUNT_1_BIT;
+    attachment[1].loadOp = late ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attachment[1].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    attachment[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachment[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachment[1].initialLayout = late ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED;
+    attachment[1].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
 
     VkAttachmentReference colorAttachment = { 0 , VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL };
+    VkAttachmentReference depthAttachment = { 1 , VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL };
 
     VkSubpassDescription subpassDesc[1] = {}; //Currently we have one but will be many
     subpassDesc[0].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
     subpassDesc[0].colorAttachmentCount = 1;
     subpassDesc[0].pColorAttachments = &colorAttachment;
+    subpassDesc[0].pDepthStencilAttachment = &depthAttachment;
+
+    //Wait for image acquire (semaphore waits at color output) and previous depth writes before clearing/loading
+    VkSubpassDependency dependency = {};
+    dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+    dependency.dstSubpass = 0;
+    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                               VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
     
     VkRenderPassCreateInfo createInfo = {};
 
@@ -474,25 +569,28 @@ VkRenderPass createRenderPass(VkDevice device, SwapChainDetails details)
     createInfo.pAttachments = attachment;
     createInfo.subpassCount = sizeof(subpassDesc) / sizeof(subpassDesc[0]);
     createInfo.pSubpasses = subpassDesc;
-    //createInfo.dependencyCount; //Not filling currently
-    //createInfo.pDependencies; //Not filling currently
+    createInfo.dependencyCount = 1;
+    createInfo.pDependencies = &dependency;
     
     VK_CHECK(vkCreateRenderPass(device, &createInfo, 0, &renderPass));
 
     return renderPass;
 }
 
-VkFramebuffer createFramebuffer(VkDevice device, VkRenderPass renderPass, VkImageView imageView)
+//Early and late render passes are compatible so one framebuffer serves both
+VkFramebuffer createFramebuffer(VkDevice device, VkRenderPass renderPass, VkImageView imageView, VkImageView depthView, VkExtent2D extent)
 {
     VkFramebuffer framebuffer;
 
+    VkImageView attachments[] = { imageView, depthView };
+
     VkFramebufferCreateInfo createInfo = {  };
     createInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
     createInfo.renderPass  = renderPass;
-    createInfo.attachmentCount = 1;
-    createInfo.pAttachments = &imageView;
-    createInfo.width = width;
-    createInfo.height = height;
+    createInfo.attachmentCount = sizeof(attachments) / sizeof(attachments[0]);
+    createInfo.pAttachments = attachments;
+    createInfo.width = extent.width;
+    createInfo.height = extent.height;
     createInfo.layers = 1;
 
     VK_CHECK(vkCreateFramebuffer(device, &createInfo, 0, &framebuffer));
@@ -501,13 +599,99 @@ VkFramebuffer createFramebuffer(VkDevice device, VkRenderPass renderPass, VkImag
 
 }
 
-std::vector<char> readFile(const std::string& fileName) 
+//Swapchain and everything created per swapchain image, replaced as a whole when the surface goes out of date
+struct SwapchainTargets
+{
+    VkUnique<VkSwapchainKHR> swapchain;
+    std::vector<VkUnique<VkImageView>> imageViews;
+    std::vector<VkUnique<VkFramebuffer>> frameBuffers;
+    Image depth; //Shared by all images, sampled as well so the depth pyramid can be built from it
+    VkExtent2D extent = {};
+};
+
+void createSwapchainTargets(SwapchainTargets& targets, GLFWwindow* window, VkDevice device, VkPhysicalDevice pDevice, const VkPhysicalDeviceMemoryProperties& memoryProperties,
+                            VkSurfaceKHR surface, QueueIndexFamily indices, SwapChainDetails details, VkRenderPass renderPass, VkFormat depthFormat, VkSwapchainKHR oldSwapchain)
+{
+    targets.extent = chooseSwapExtent(details.capabilities, window);
+    targets.swapchain = makeUnique(device, createSwapchain(device, pDevice, surface, indices, details, targets.extent, oldSwapchain), vkDestroySwapchainKHR);
+    assert(targets.swapchain);
+
+    targets.depth = createImage(device, memoryProperties, targets.extent.width, targets.extent.height, 1, depthFormat,
+                                VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_IMAGE_ASPECT_DEPTH_BIT);
+    assert(targets.depth.image);
+
+    uint32_t imageCount = 0;
+    VK_CHECK(vkGetSwapchainImagesKHR(device, targets.swapchain, &imageCount, 0));
+    assert(imageCount != 0);
+
+    std::vector<VkImage> images(imageCount);
+    VK_CHECK(vkGetSwapchainImagesKHR(device, targets.swapchain, &imageCount, images.data()));
+
+    targets.imageViews.resize(imageCount);
+    targets.frameBuffers.resize(imageCount);
+
+    for (uint32_t i = 0; i < imageCount; i++)
+    {
+        targets.imageViews[i] = makeUnique(device, createImageView(device, images[i], details), vkDestroyImageView);
+        assert(targets.imageViews[i]);
+
+        targets.frameBuffers[i] = makeUnique(device, createFramebuffer(device, renderPass, targets.imageViews[i], targets.depth.view, targets.extent), vkDestroyFramebuffer);
+        assert(targets.frameBuffers[i]);
+    }
+}
+
+//Frames still in flight may present from the old swapchain, so it and its views retire with lastUse instead of draining the device
+//Returns false if the window was closed while minimized and nothing was recreated
+bool recreateSwapchainTargets(SwapchainTargets& targets, DeletionQueue& deletionQueue, uint64_t lastUse, GLFWwindow* window, VkDevice device, VkPhysicalDevice pDevice,
+                              const VkPhysicalDeviceMemoryProperties& memoryProperties, VkSurfaceKHR surface, QueueIndexFamily indices, VkRenderPass renderPass)
+{
+    //Minimized window has a zero sized surface, nothing can be presented until it is restored
+    int framebufferWidth = 0, framebufferHeight = 0;
+    glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+
+    while ((framebufferWidth == 0 || framebufferHeight == 0) && !glfwWindowShouldClose(window))
+    {
+        glfwWaitEvents();
+        glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+    }
+
+    if (glfwWindowShouldClose(window))
+    {
+        return false;
+    }
+
+    SwapChainDetails details = getSurfaceCompatibility(pDevice, surface);
+
+    SwapchainTargets next;
+    createSwapchainTargets(next, window, device, pDevice, memoryProperties, surface, indices, details, renderPass, targets.depth.format, targets.swapchain);
+
+    for (auto& frameBuffer : targets.frameBuffers)
+    {
+        deletionQueue.push(lastUse, std::move(frameBuffer));
+    }
+
+    for (auto& imageView : targets.imageViews)
+    {
+        deletionQueue.push(lastUse, std::move(imageView));
+    }
+
+    deletionQueue.push(lastUse, std::move(targets.swapchain));
+
+    retireImage(deletionQueue, lastUse, targets.depth);
+
+    targets = std::move(next);
+
+    return true;
+}
+
+//missingHint is appended to the error when the file can not be opened
+std::vector<char> readFile(const std::string& fileName, const std::string& missingHint = "")
 {
     std::ifstream file(fileName, std::ios::ate | std::ios::binary);
 
     if (!file.is_open())
     {
-        throw std::runtime_error("Failed to open " + fileName + "\n");
+        throw std::runtime_error("Failed to open " + fileName + missingHint + "\n");
     }
 
     size_t fileSize = static_cast<size_t>(file.tellg());
@@ -519,6 +703,12 @@ std::vector<char> readFile(const std::string& fileName)
     return buffer;
 }
 
+//SPIR-V is not checked in, Shaders/compileshaders builds it from the .glsl sources
+std::vector<char> readShader(const std::string& fileName)
+{
+    return readFile(fileName, ", run Shaders/compileshaders to build the SPIR-V");
+}
+
 VkShaderModule createShaderModule(VkDevice device, std::vector<char>& buffer)
 {
     VkShaderModule module;
@@ -532,24 +722,8 @@ VkShaderModule createShaderModule(VkDevice device, std::vector<char>& buffer)
     return module;
 }
 
-VkPipelineLayout createPipilineLayout(VkDevice device)
-{
-    VkPipelineLayout pipelineLayout;
-    /*We need mechanism to pass uniforms to shaders but we dont want to modify graphics pipeline
-     So we create pipeline layout object*/
-    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
-    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutInfo.setLayoutCount = 0;
-    pipelineLayoutInfo.pSetLayouts = nullptr;
-    pipelineLayoutInfo.pushConstantRangeCount = 0;
-    pipelineLayoutInfo.pPushConstantRanges = nullptr;
-
-    VK_CHECK(vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout));
-
-    return pipelineLayout;
-}
-
-VkPipeline createGraphicsPipeline(VkDevice device, VkShaderModule vs, VkShaderModule fs, VkRenderPass renderPass, VkPipelineLayout pipelineLayout)
+//Transparent pipelines blend over what is there and test against depth without writing it
+VkPipeline createGraphicsPipeline(VkDevice device, VkShaderModule vs, VkShaderModule fs, VkRenderPass renderPass, VkPipelineLayout pipelineLayout, bool transparent)
 {
     VkPipeline graphicsPipeline;
 
@@ -607,15 +781,22 @@ VkPipeline createGraphicsPipeline(VkDevice device, VkShaderModule vs, VkShaderMo
     multisampling.alphaToCoverageEnable = VK_FALSE;
     multisampling.alphaToOneEnable = VK_FALSE;
 
-    //Depth and Stenciling ---> Currently we will pass nullptr
+    //Depth and Stenciling, reverse Z so closer is greater
+    VkPipelineDepthStencilStateCreateInfo depthStencil = {};
+    depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depthStencil.depthTestEnable = VK_TRUE;
+    depthStencil.depthWriteEnable = transparent ? VK_FALSE : VK_TRUE;
+    depthStencil.depthCompareOp = VK_COMPARE_OP_GREATER;
+    depthStencil.depthBoundsTestEnable = VK_FALSE;
+    depthStencil.stencilTestEnable = VK_FALSE;
 
     //Color Blending
     VkPipelineColorBlendAttachmentState colorBlendAttachment = {};
     colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
         VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-    colorBlendAttachment.blendEnable = VK_FALSE;
-    colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
-    colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
+    colorBlendAttachment.blendEnable = transparent ? VK_TRUE : VK_FALSE;
+    colorBlendAttachment.srcColorBlendFactor = transparent ? VK_BLEND_FACTOR_SRC_ALPHA : VK_BLEND_FACTOR_ONE;
+    colorBlendAttachment.dstColorBlendFactor = transparent ? VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA : VK_BLEND_FACTOR_ONE;
     colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;;
     colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
     colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
@@ -654,7 +835,7 @@ VkPipeline createGraphicsPipeline(VkDevice device, VkShaderModule vs, VkShaderMo
     pipelineInfo.pViewportState = &viewportState;
     pipelineInfo.pRasterizationState = &rasterizer;
     pipelineInfo.pMultisampleState = &multisampling;
-    pipelineInfo.pDepthStencilState = nullptr; // Optional
+    pipelineInfo.pDepthStencilState = &depthStencil;
     pipelineInfo.pColorBlendState = &colorBlending;
     pipelineInfo.pDynamicState = &dynamicState; // Optional
     pipelineInfo.layout = pipelineLayout;
@@ -668,6 +849,168 @@ VkPipeline createGraphicsPipeline(VkDevice device, VkShaderModule vs, VkShaderMo
     return graphicsPipeline;
 }
 
+//Matches ObjectData in triangle.vert.glsl and drawcull.comp.glsl
+struct ObjectData
+{
+    float sphere[4]; //xyz center in view space, w radius which is also the scale of the unit sized mesh
+};
+
+//Matches Camera push constants in triangle.vert.glsl
+struct CameraData
+{
+    float P00, P11;
+    float znear;
+};
+
+//Hack : No asset loading yet, unit sphere dense enough for LODs to matter
+void createSphereMesh(uint32_t rings, uint32_t segments, std::vector<Vertex>& outVertices, std::vector<uint32_t>& outIndices)
+{
+    const float pi = 3.14159265f;
+
+    for (uint32_t r = 0; r <= rings; r++)
+    {
+        float theta = pi * float(r) / float(rings);
+
+        for (uint32_t s = 0; s <= segments; s++)
+        {
+            float phi = 2.0f * pi * float(s) / float(segments);
+
+            float x = sinf(theta) * cosf(phi);
+            float y = cosf(theta);
+            float z = sinf(theta) * sinf(phi);
+
+            outVertices.push_back({ { x, y, z }, { x, y, z } });
+        }
+    }
+
+    for (uint32_t r = 0; r < rings; r++)
+    {
+        for (uint32_t s = 0; s < segments; s++)
+        {
+            uint32_t a = r * (segments + 1) + s;
+            uint32_t b = a + segments + 1;
+
+            //Counter clockwise seen from outside so meshlet normal cones point outwards
+            outIndices.insert(outIndices.end(), { a, a + 1, b, a + 1, b + 1, b });
+        }
+    }
+}
+
+//Hack : No scene loading yet, a few large occluders close to camera in front of a field of small objects
+std::vector<ObjectData> createScene(uint32_t objectCount)
+{
+    std::vector<ObjectData> objects;
+    objects.reserve(objectCount);
+
+    const float occluders[][4] =
+    {
+        { -3.0f,  2.0f, 8.0f, 4.0f },
+        {  3.0f,  2.0f, 8.0f, 4.0f },
+        { -3.0f, -2.0f, 8.0f, 4.0f },
+        {  3.0f, -2.0f, 8.0f, 4.0f },
+    };
+
+    for (const auto& occluder : occluders)
+    {
+        objects.push_back({ { occluder[0], occluder[1], occluder[2], occluder[3] } });
+    }
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> depth(15.0f, 100.0f);
+
+    while (objects.size() < objectCount)
+    {
+        float z = depth(rng);
+        objects.push_back({ { unit(rng) * z * 0.9f, unit(rng) * z * 0.7f, z, 0.5f } });
+    }
+
+    return objects;
+}
+
+//Hack : No light assets yet, lights scattered through the object field, every fourth one a spot
+std::vector<Light> createLights(uint32_t lightCount)
+{
+    std::vector<Light> lights(lightCount);
+
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> depth(5.0f, 100.0f);
+    std::uniform_real_distribution<float> radius(1.5f, 5.0f);
+    std::uniform_real_distribution<float> channel(0.2f, 1.0f);
+
+    const float spotOuter = 30.0f * 3.14159265f / 180.0f;
+    const float spotInner = 20.0f * 3.14159265f / 180.0f;
+    const float intensity = 4.0f;
+
+    for (uint32_t i = 0; i < lightCount; i++)
+    {
+        Light& light = lights[i];
+
+        float z = depth(rng);
+        light.position[0] = unit(rng) * z * 0.9f;
+        light.position[1] = unit(rng) * z * 0.7f;
+        light.position[2] = z;
+        light.radius = radius(rng);
+
+        light.color[0] = channel(rng) * intensity;
+        light.color[1] = channel(rng) * intensity;
+        light.color[2] = channel(rng) * intensity;
+
+        light.spotCosOuter = -2.0f;
+        light.spotCosInner = -2.0f;
+
+        if (i % 4 == 0)
+        {
+            float direction[3] = { unit(rng), unit(rng), unit(rng) };
+            float length = sqrtf(direction[0] * direction[0] + direction[1] * direction[1] + direction[2] * direction[2]);
+            length = std::max(length, 1e-3f);
+
+            light.direction[0] = direction[0] / length;
+            light.direction[1] = direction[1] / length;
+            light.direction[2] = direction[2] / length;
+
+            //Spots reach further along their cone than point lights
+            light.radius *= 2.0f;
+            light.spotCosOuter = cosf(spotOuter);
+            light.spotCosInner = cosf(spotInner);
+        }
+    }
+
+    return lights;
+}
+
+struct FrameResources
+{
+    VkUnique<VkSemaphore> imageAquired;
+    VkUnique<VkSemaphore> cmdSubmited;
+    VkUnique<VkFence> inFlight;
+    VkUnique<VkCommandPool> pool;
+    VkCommandBuffer cmdBuffer; //Freed along with pool
+    VkCommandBuffer readbackCmdBuffer; //Stats copies for the CPU, submitted after cmdBuffer, freed along with pool
+
+    //Particle update on the compute queue, writes the draw data of this frame only so it overlaps the previous frame
+    VkUnique<VkSemaphore> particlesReady;
+    VkUnique<VkCommandPool> computePool;
+    VkCommandBuffer computeCmdBuffer; //Freed along with computePool
+};
+
+//Hack : No particle assets yet, one fountain in front of the occluders
+ParticleParams createFountain()
+{
+    ParticleParams params = {};
+    params.emitterPosition[0] = 0.0f;
+    params.emitterPosition[1] = -4.0f;
+    params.emitterPosition[2] = 20.0f;
+    params.emitterRadius = 0.5f;
+    params.gravity[1] = -9.8f;
+    params.lifetime = 3.0f;
+    params.speed = 12.0f;
+    params.size = 0.05f;
+
+    return params;
+}
+
 int main()
 {
     int rc = glfwInit();
@@ -695,137 +1038,558 @@ int main()
     VkPhysicalDevice physicalDevice = pickPhysicalDevice(instance, surface, indices, details);
     assert(physicalDevice);
 
-    VkDevice device = createLogicalDevice(physicalDevice, surface, indices);
+    //Budget numbers from the driver, without it the tracker estimates them from heap sizes
+    bool memoryBudgetSupported = isDeviceExtensionSupported(physicalDevice, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+
+    VkDevice device = createLogicalDevice(physicalDevice, surface, indices, memoryBudgetSupported);
     assert(device);
-  
-    VkSwapchainKHR swapChain = createSwapchain(device, physicalDevice, surface, indices, details);
-    assert(swapChain);
-
-    uint32_t swapchainImageCount = 0;
-    std::vector<VkImage> images;
-    VK_CHECK(vkGetSwapchainImagesKHR(device, swapChain, &swapchainImageCount, 0));
-    assert(swapchainImageCount != 0);
-    images.resize(swapchainImageCount);
-    VK_CHECK(vkGetSwapchainImagesKHR(device, swapChain, &swapchainImageCount, images.data()));
-    assert(images.size() != 0);
-
-    std::vector<VkImageView> imageViews(swapchainImageCount);
-    for (uint32_t i = 0; i < swapchainImageCount; i++)
+
+    //Before the first allocation, every buffer and image allocates through the tracker
+    MemoryTracker& memoryTracker = getMemoryTracker();
+    memoryTracker.init(physicalDevice, memoryBudgetSupported);
+
+    //Everything created from device lives in this scope so RAII handles are gone before vkDestroyDevice
     {
-        imageViews[i] = createImageView(device, images[i] , details);
-        assert(imageViews[i]);
-    }
+        //Released objects wait here until the last frame that used them has retired
+        DeletionQueue deletionQueue;
+
+        VkPhysicalDeviceMemoryProperties memoryProperties;
+        vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+
+        VkPhysicalDeviceProperties deviceProperties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+
+        uint32_t queueFamilyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, 0);
+        std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+
+        //Culling and drawing are both recorded on the graphics queue
+        uint32_t timestampValidBits = queueFamilies[indices.graphicsFamily.value()].timestampValidBits;
+
+        const VkFormat depthFormat = VK_FORMAT_D32_SFLOAT;
+
+        VkUnique<VkRenderPass> renderPass = makeUnique(device, createRenderPass(device, details, depthFormat, false), vkDestroyRenderPass);
+        assert(renderPass);
+        VkUnique<VkRenderPass> lateRenderPass = makeUnique(device, createRenderPass(device, details, depthFormat, true), vkDestroyRenderPass);
+        assert(lateRenderPass);
+
+        //Built from the .glsl next to them by Shaders/compileshaders
+        std::vector<char> vsCode = readShader("Shaders/triangle.vert.spv");
+        std::vector<char> fsCode = readShader("Shaders/triangle.frag.spv");
+        std::vector<char> reduceCode = readShader("Shaders/depthreduce.comp.spv");
+        std::vector<char> cullCode = readShader("Shaders/drawcull.comp.spv");
+        std::vector<char> particleVsCode = readShader("Shaders/particle.vert.spv");
+        std::vector<char> particleFsCode = readShader("Shaders/particle.frag.spv");
+        std::vector<char> particleResetCode = readShader("Shaders/particlereset.comp.spv");
+        std::vector<char> particleUpdateCode = readShader("Shaders/particleupdate.comp.spv");
+        std::vector<char> particleEmitCode = readShader("Shaders/particleemit.comp.spv");
+        std::vector<char> particleSimulateCode = readShader("Shaders/particlesimulate.comp.spv");
+        std::vector<char> radixSortCode = readShader("Shaders/radixsort.comp.spv");
+        std::vector<char> lightBinCode = readShader("Shaders/lightbin.comp.spv");
+        assert(vsCode.size() != 0);
+        assert(fsCode.size() != 0);
+        assert(reduceCode.size() != 0);
+        assert(cullCode.size() != 0);
+
+        VkUnique<VkShaderModule> vs = makeUnique(device, createShaderModule(device, vsCode), vkDestroyShaderModule);
+        assert(vs);
+        VkUnique<VkShaderModule> fs = makeUnique(device, createShaderModule(device, fsCode), vkDestroyShaderModule);
+        assert(fs);
+        VkUnique<VkShaderModule> reduceCs = makeUnique(device, createShaderModule(device, reduceCode), vkDestroyShaderModule);
+        assert(reduceCs);
+        VkUnique<VkShaderModule> cullCs = makeUnique(device, createShaderModule(device, cullCode), vkDestroyShaderModule);
+        assert(cullCs);
+        VkUnique<VkShaderModule> particleVs = makeUnique(device, createShaderModule(device, particleVsCode), vkDestroyShaderModule);
+        assert(particleVs);
+        VkUnique<VkShaderModule> particleFs = makeUnique(device, createShaderModule(device, particleFsCode), vkDestroyShaderModule);
+        assert(particleFs);
+        VkUnique<VkShaderModule> particleResetCs = makeUnique(device, createShaderModule(device, particleResetCode), vkDestroyShaderModule);
+        assert(particleResetCs);
+        VkUnique<VkShaderModule> particleUpdateCs = makeUnique(device, createShaderModule(device, particleUpdateCode), vkDestroyShaderModule);
+        assert(particleUpdateCs);
+        VkUnique<VkShaderModule> particleEmitCs = makeUnique(device, createShaderModule(device, particleEmitCode), vkDestroyShaderModule);
+        assert(particleEmitCs);
+        VkUnique<VkShaderModule> particleSimulateCs = makeUnique(device, createShaderModule(device, particleSimulateCode), vkDestroyShaderModule);
+        assert(particleSimulateCs);
+        VkUnique<VkShaderModule> radixSortCs = makeUnique(device, createShaderModule(device, radixSortCode), vkDestroyShaderModule);
+        assert(radixSortCs);
+        VkUnique<VkShaderModule> lightBinCs = makeUnique(device, createShaderModule(device, lightBinCode), vkDestroyShaderModule);
+        assert(lightBinCs);
+
+        VkQueue queue;
+        vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &queue); //Hack needs to get separate present and graphics q
+
+        //Same queue as graphics when the device has no compute only family, the scheduler handles both
+        VkQueue computeQueue;
+        vkGetDeviceQueue(device, indices.computeFamily.value(), 0, &computeQueue);
+
+        //Particle buffers are shared by both families
+        uint32_t particleFamilies[] = { indices.graphicsFamily.value(), indices.computeFamily.value() };
+        uint32_t particleFamilyCount = particleFamilies[0] == particleFamilies[1] ? 1 : 2;
+
+        VkUnique<VkCommandPool> uploadPool = makeUnique(device, createCommandPool(device, indices.graphicsFamily.value()), vkDestroyCommandPool);
+        assert(uploadPool);
+
+        //Processing runs once, later runs load the result from the cache
+        std::vector<Vertex> sourceVertices;
+        std::vector<uint32_t> sourceIndices;
+        createSphereMesh(96, 192, sourceVertices, sourceIndices);
+
+        //Not fatal when the cache can not be written, the mesh is still processed and the next run processes it again
+        ProcessedMesh mesh;
+        if (!loadProcessedMesh(sourceVertices, sourceIndices, "Cache", mesh))
+        {
+            printf("Mesh cache is not writable, mesh will be processed again on next run\n");
+        }
+        assert(!mesh.lods.empty());
 
-    VkRenderPass renderPass = createRenderPass(device, details);
-    assert(renderPass);
+        //Copies go out with the first frame's submission instead of one submit and queue wait each
+        UploadBatch uploads = beginUploadBatch(device, uploadPool);
 
-    std::vector<char> vsCode = readFile("Shaders/vert.spv");
-    std::vector<char> fsCode = readFile("Shaders/frag.spv");
-    assert(vsCode.size() != 0);
-    assert(fsCode.size() != 0);
+        Buffer vertexBuffer = createBuffer(device, memoryProperties, mesh.vertices.size() * sizeof(Vertex),
+                                           VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        uploadBuffer(device, memoryProperties, uploads, vertexBuffer, mesh.vertices.data(), vertexBuffer.size);
 
-    VkShaderModule vs = createShaderModule(device, vsCode);
-    assert(vs);
-    VkShaderModule fs = createShaderModule(device, fsCode);
-    assert(fs);
+        Buffer indexBuffer = createBuffer(device, memoryProperties, mesh.indices.size() * sizeof(uint32_t),
+                                          VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        uploadBuffer(device, memoryProperties, uploads, indexBuffer, mesh.indices.data(), indexBuffer.size);
 
-    VkPipelineLayout pipelineLayout = createPipilineLayout(device);
-    assert(pipelineLayout);
+        Buffer lodBuffer = createBuffer(device, memoryProperties, mesh.lods.size() * sizeof(MeshLod),
+                                        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        uploadBuffer(device, memoryProperties, uploads, lodBuffer, mesh.lods.data(), lodBuffer.size);
 
-    VkPipeline graphicsPipeline = createGraphicsPipeline(device, vs, fs, renderPass, pipelineLayout);
-    assert(graphicsPipeline);
+        //Meshlet triangles index the same ranges of indexBuffer, only bounds and cones are needed on GPU
+        Buffer meshletBuffer = createBuffer(device, memoryProperties, mesh.meshlets.size() * sizeof(Meshlet),
+                                            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        uploadBuffer(device, memoryProperties, uploads, meshletBuffer, mesh.meshlets.data(), meshletBuffer.size);
 
-    std::vector<VkFramebuffer> frameBuffers(swapchainImageCount);
-    for (uint32_t i = 0; i < swapchainImageCount; i++)
-    {
-        frameBuffers[i] = createFramebuffer(device, renderPass, imageViews[i]);
-        assert(frameBuffers[i]);
-    }
+        //Every shader variant is created here up front
+        PermutationCache permutations;
 
-    VkQueue queue;
-    vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &queue); //Hack needs to get separate present and graphics q
+        const uint32_t maxParticles = 1 << 20;
+        const float particleEmitRate = 100000.0f; //Per second
 
-    VkSemaphore imageAquired = createSemaphore(device);
-    assert(imageAquired);
-    VkSemaphore cmdSubmited = createSemaphore(device);
-    assert(cmdSubmited);
+        ParticleSystem particles;
+        createParticleSystem(particles, device, memoryProperties, maxParticles, maxFramesInFlight, particleFamilies, particleFamilyCount,
+                             particleResetCs, particleUpdateCs, particleEmitCs, particleSimulateCs, radixSortCs, permutations);
 
-    VkCommandPool pool = createCommandPool(device, physicalDevice, surface, indices);
-    assert(pool);
-    
-    VkCommandBuffer cmdBuffer = createCommandBuffer(device, pool);
-    assert(cmdBuffer);
+        const uint32_t lightCount = 16384;
+        const float clusterFar = 120.0f; //Just past the farthest light of createLights
 
-    VkClearColorValue color = { 0.0f, 0.0f, 0.0f, 1.0f };
+        std::vector<Light> sceneLights = createLights(lightCount);
 
-    while (!glfwWindowShouldClose(window))
-    {
-        glfwPollEvents();
+        ClusteredLighting lighting;
+        createClusteredLighting(lighting, device, memoryProperties, sceneLights, maxFramesInFlight, uploads, lightBinCs, permutations);
+
+        endUploadBatch(uploads);
+
+        const uint32_t objectCount = 10000;
+        std::vector<ObjectData> scene = createScene(objectCount);
+
+        Buffer objects = createBuffer(device, memoryProperties, scene.size() * sizeof(ObjectData), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        memcpy(objects.data, scene.data(), scene.size() * sizeof(ObjectData));
+
+        //Vertex shader fetches object data with gl_InstanceIndex, culling passes the object index as firstInstance
+        //Fragment shader reads the lights of its cluster
+        VkDescriptorSetLayoutBinding objectBindings[] =
+        {
+            { 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT, 0 },
+            { 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_VERTEX_BIT, 0 },
+            { 2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_FRAGMENT_BIT, 0 },
+            { 3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_FRAGMENT_BIT, 0 },
+            { 4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_FRAGMENT_BIT, 0 },
+            { 5, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1, VK_SHADER_STAGE_FRAGMENT_BIT, 0 },
+        };
+
+        VkUnique<VkDescriptorSetLayout> setLayout = makeUnique(device, createDescriptorSetLayout(device, objectBindings, sizeof(objectBindings) / sizeof(objectBindings[0])), vkDestroyDescriptorSetLayout);
+        assert(setLayout);
+        VkUnique<VkDescriptorPool> descriptorPool = makeUnique(device, createDescriptorPool(device, 1), vkDestroyDescriptorPool);
+        assert(descriptorPool);
+
+        VkDescriptorSet objectSet = allocateDescriptorSet(device, descriptorPool, setLayout);
+        writeBufferDescriptor(device, objectSet, 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, objects.buffer);
+        writeBufferDescriptor(device, objectSet, 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, vertexBuffer.buffer);
+        writeBufferDescriptor(device, objectSet, 2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, lighting.lights.buffer);
+        writeBufferDescriptor(device, objectSet, 3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, lighting.clusters.buffer);
+        writeBufferDescriptor(device, objectSet, 4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, lighting.lightIndices.buffer);
+        writeBufferDescriptor(device, objectSet, 5, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, lighting.grid.buffer);
+
+        VkUnique<VkPipelineLayout> pipelineLayout = makeUnique(device, createPipelineLayout(device, setLayout, sizeof(CameraData), VK_SHADER_STAGE_VERTEX_BIT), vkDestroyPipelineLayout);
+        assert(pipelineLayout);
+
+        VkUnique<VkPipeline> graphicsPipeline = makeUnique(device, createGraphicsPipeline(device, vs, fs, renderPass, pipelineLayout, false), vkDestroyPipeline);
+        assert(graphicsPipeline);
+
+        SwapchainTargets swapchainTargets;
+        createSwapchainTargets(swapchainTargets, window, device, physicalDevice, memoryProperties, surface, indices, details, renderPass, depthFormat, VK_NULL_HANDLE);
+
+        VkUnique<VkPipelineLayout> particleLayout = makeUnique(device, createPipelineLayout(device, particles.drawSetLayout, sizeof(CameraData), VK_SHADER_STAGE_VERTEX_BIT), vkDestroyPipelineLayout);
+        assert(particleLayout);
+
+        VkUnique<VkPipeline> particlePipeline = makeUnique(device, createGraphicsPipeline(device, particleVs, particleFs, renderPass, particleLayout, true), vkDestroyPipeline);
+        assert(particlePipeline);
+
+        OcclusionCulling culling;
+        createOcclusionCulling(culling, device, memoryProperties, deviceProperties.limits, timestampValidBits, swapchainTargets.depth.view, swapchainTargets.extent.width, swapchainTargets.extent.height,
+                               objects.buffer, objectCount, lodBuffer.buffer, static_cast<uint32_t>(mesh.lods.size()), meshletBuffer.buffer, maxFramesInFlight, reduceCs, cullCs, permutations);
+
+        //Modules are only needed while creating the pipeline
+        vs.reset();
+        fs.reset();
+        reduceCs.reset();
+        cullCs.reset();
+        particleVs.reset();
+        particleFs.reset();
+        particleResetCs.reset();
+        particleUpdateCs.reset();
+        particleEmitCs.reset();
+        particleSimulateCs.reset();
+        radixSortCs.reset();
+        lightBinCs.reset();
+
+        FrameResources frames[maxFramesInFlight];
+        for (auto& frame : frames)
+        {
+            frame.imageAquired = makeUnique(device, createSemaphore(device), vkDestroySemaphore);
+            assert(frame.imageAquired);
+            frame.cmdSubmited = makeUnique(device, createSemaphore(device), vkDestroySemaphore);
+            assert(frame.cmdSubmited);
+            frame.inFlight = makeUnique(device, createFence(device), vkDestroyFence);
+            assert(frame.inFlight);
+
+            frame.pool = makeUnique(device, createCommandPool(device, indices.graphicsFamily.value()), vkDestroyCommandPool);
+            assert(frame.pool);
+
+            frame.cmdBuffer = createCommandBuffer(device, frame.pool);
+            assert(frame.cmdBuffer);
+
+            frame.readbackCmdBuffer = createCommandBuffer(device, frame.pool);
+            assert(frame.readbackCmdBuffer);
+
+            frame.particlesReady = makeUnique(device, createSemaphore(device), vkDestroySemaphore);
+            assert(frame.particlesReady);
+
+            frame.computePool = makeUnique(device, createCommandPool(device, indices.computeFamily.value()), vkDestroyCommandPool);
+            assert(frame.computePool);
+
+            frame.computeCmdBuffer = createCommandBuffer(device, frame.computePool);
+            assert(frame.computeCmdBuffer);
+        }
+
+        float fovY = 70.0f * 3.14159265f / 180.0f;
+
+        VkClearColorValue color = { 0.0f, 0.0f, 0.0f, 1.0f };
+
+        //Every producer hands its command buffers here, one vkQueueSubmit per queue per frame
+        SubmissionScheduler scheduler;
+
+        uint64_t frameNumber = 0;
+
+        //Handlers run from memoryTracker.update() at the start of a frame, before anything is recorded,
+        //so released memory retires with the current frame number. Particles go first, they hold the most.
+        memoryTracker.addEvictionHandler([&particles, &deletionQueue, &frameNumber, device, &memoryProperties](uint32_t heapIndex, VkDeviceSize bytesToFree)
+        {
+            return evictParticleSystem(particles, deletionQueue, frameNumber, device, memoryProperties, heapIndex, bytesToFree);
+        });
+        memoryTracker.addEvictionHandler([&culling, &deletionQueue, &frameNumber, &swapchainTargets, device, &memoryProperties](uint32_t heapIndex, VkDeviceSize bytesToFree)
+        {
+            return evictDepthPyramid(culling, deletionQueue, frameNumber, device, memoryProperties, swapchainTargets.depth.view,
+                                     swapchainTargets.extent.width, swapchainTargets.extent.height, heapIndex, bytesToFree);
+        });
+
+        ParticleParams fountain = createFountain();
+        float particleEmitCarry = 0.0f; //Fraction of a particle left over from the previous frame
+        double lastTime = glfwGetTime();
+
+        while (!glfwWindowShouldClose(window))
+        {
+            glfwPollEvents();
 
-        uint32_t imageIndex = 0;
-        VK_CHECK(vkAcquireNextImageKHR(device, swapChain, ~0ull, imageAquired, 0, &imageIndex));
+            double time = glfwGetTime();
+            float deltaTime = std::min(static_cast<float>(time - lastTime), 0.1f); //Do not emit a burst after a hitch
+            lastTime = time;
 
-        VK_CHECK(vkResetCommandPool(device, pool, 0)); //Make command buffer reusable 
+            uint32_t frameIndex = static_cast<uint32_t>(frameNumber % maxFramesInFlight);
+            FrameResources& frame = frames[frameIndex];
 
-        VkCommandBufferBeginInfo beginInfo = {};
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+            //Waiting on this slot's fence means frame (frameNumber - maxFramesInFlight) is done on GPU,
+            //so anything released up to that frame can be destroyed without stalling the device
+            VK_CHECK(vkWaitForFences(device, 1, frame.inFlight.address(), VK_TRUE, ~0ull));
 
-        VK_CHECK(vkBeginCommandBuffer(cmdBuffer, &beginInfo));
+            if (frameNumber >= maxFramesInFlight)
+            {
+                deletionQueue.collect(frameNumber - maxFramesInFlight);
+            }
+
+            scheduler.beginFrame();
+            const SubmitStats& submitStats = scheduler.getStats();
+
+            //Evicted memory comes back a step at a time, before update so the driver numbers include it
+            restoreDepthPyramid(culling, deletionQueue, frameNumber, device, memoryProperties, swapchainTargets.depth.view,
+                                swapchainTargets.extent.width, swapchainTargets.extent.height);
+            restoreParticleSystem(particles, deletionQueue, frameNumber, device, memoryProperties);
+
+            //Runs eviction handlers of streaming systems when a heap gets close to its budget
+            memoryTracker.update();
+
+            OcclusionStats stats;
+            LightStats lightStats = readLightStats(lighting, frameIndex);
+            if (readOcclusionStats(device, culling, frameIndex, stats))
+            {
+                char timings[64] = "cull n/a, pyramid n/a";
+                if (stats.timingsValid)
+                {
+                    snprintf(timings, sizeof(timings), "cull %.3f ms, pyramid %.3f ms", stats.cullEarlyMs + stats.cullLateMs, stats.pyramidMs);
+                }
+
+                //Device local heaps summed, that is where running out hurts
+                VkDeviceSize vramUsage = 0, vramBudget = 0;
+                bool vramOverBudget = false;
+                for (const HeapBudget& heap : memoryTracker.getHeaps())
+                {
+                    if (heap.deviceLocal)
+                    {
+                        vramUsage += heap.driverUsage;
+                        vramBudget += heap.budget;
+                        vramOverBudget = vramOverBudget || heap.overBudget;
+                    }
+                }
+
+                //Eviction state, over budget means nothing was left to evict
+                char memoryState[96] = "";
+                if (particles.capacityShift != 0)
+                {
+                    snprintf(memoryState, sizeof(memoryState), " - particles at 1/%u", 1u << particles.capacityShift);
+                }
+                if (culling.pyramidShift != 0)
+                {
+                    size_t length = strlen(memoryState);
+                    snprintf(memoryState + length, sizeof(memoryState) - length, " - HiZ at 1/%u", 1u << culling.pyramidShift);
+                }
+                if (vramOverBudget)
+                {
+                    strcat(memoryState, " - over budget");
+                }
+
+                char title[512];
+                snprintf(title, sizeof(title), "Nirvana - visible %u, occluded %u, frustum culled %u of %u - %u triangles, %u meshlets culled, %u lights, %u dropped in %u clusters - %s - %u submits, driver %.3f ms - VRAM %llu / %llu MB%s",
+                         stats.visibleCount, stats.occludedCount, stats.frustumCulledCount, stats.objectCount, stats.triangleCount, stats.meshletCulledCount, lighting.lightCount,
+                         lightStats.droppedLightCount, lightStats.truncatedClusterCount, timings,
+                         submitStats.submitCount, submitStats.driverMs,
+                         static_cast<unsigned long long>(vramUsage >> 20), static_cast<unsigned long long>(vramBudget >> 20), memoryState);
+                glfwSetWindowTitle(window, title);
+            }
+
+            //Image is not acquired and the semaphore not signaled when out of date, start the frame over on the new swapchain
+            uint32_t imageIndex = 0;
+            VkResult acquireResult = vkAcquireNextImageKHR(device, swapchainTargets.swapchain, ~0ull, frame.imageAquired, 0, &imageIndex);
+
+            if (acquireResult == VK_ERROR_OUT_OF_DATE_KHR)
+            {
+                if (recreateSwapchainTargets(swapchainTargets, deletionQueue, frameNumber, window, device, physicalDevice, memoryProperties, surface, indices, renderPass))
+                {
+                    resizeOcclusionCulling(culling, deletionQueue, frameNumber, device, memoryProperties, swapchainTargets.depth.view,
+                                           swapchainTargets.extent.width, swapchainTargets.extent.height);
+                }
+                continue;
+            }
+            assert(acquireResult == VK_SUCCESS || acquireResult == VK_SUBOPTIMAL_KHR);
+
+            //Only once this frame is certain to submit, otherwise the slot's next wait would never return
+            VK_CHECK(vkResetFences(device, 1, frame.inFlight.address()));
+
+            VK_CHECK(vkResetCommandPool(device, frame.pool, 0)); //Make command buffer reusable 
+
+            VkCommandBuffer cmdBuffer = frame.cmdBuffer;
+
+            VkCommandBufferBeginInfo beginInfo = {};
+            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+            //Particle update records the same commands whatever the particle count
+            VK_CHECK(vkResetCommandPool(device, frame.computePool, 0));
+            VK_CHECK(vkBeginCommandBuffer(frame.computeCmdBuffer, &beginInfo));
+
+            float particleEmit = particleEmitRate * deltaTime + particleEmitCarry;
+            fountain.emitRequest = static_cast<uint32_t>(particleEmit);
+            fountain.deltaTime = deltaTime;
+            fountain.seed = static_cast<uint32_t>(frameNumber);
+            particleEmitCarry = particleEmit - static_cast<float>(fountain.emitRequest);
+
+            recordParticleUpdate(frame.computeCmdBuffer, particles, fountain, frameIndex);
+
+            VK_CHECK(vkEndCommandBuffer(frame.computeCmdBuffer));
+
+            VK_CHECK(vkBeginCommandBuffer(cmdBuffer, &beginInfo));
+
+            beginOcclusionFrame(cmdBuffer, culling, frameIndex);
+
+            VkClearValue clearValues[2] = {};
+            clearValues[0].color = color;
+            clearValues[1].depthStencil = { 0.0f, 0 }; //Reverse Z, 0 is infinitely far
+
+            //Vulkan flips +Y so we flip the viewport
+            VkExtent2D extent = swapchainTargets.extent;
+            VkViewport viewport = {0, static_cast<float>(extent.height), static_cast<float>(extent.width), -static_cast<float>(extent.height) , 0, 1};
+            VkRect2D scissor = { {0, 0}, extent };
+
+            //Reverse Z infinite perspective, see triangle.vert.glsl. Aspect follows the swapchain so it is rebuilt every frame
+            CameraData camera = {};
+            camera.P11 = 1.0f / tanf(fovY / 2.0f);
+            camera.P00 = camera.P11 / (float(extent.width) / float(extent.height));
+            camera.znear = 0.1f;
+
+            CullData cullView = {};
+            cullView.P00 = camera.P00;
+            cullView.P11 = camera.P11;
+            cullView.znear = camera.znear;
+
+            //Side planes in view space, x/z of left-right plane and y/z of top-bottom plane
+            cullView.frustum[0] = camera.P00 / sqrtf(camera.P00 * camera.P00 + 1.0f);
+            cullView.frustum[1] = 1.0f / sqrtf(camera.P00 * camera.P00 + 1.0f);
+            cullView.frustum[2] = camera.P11 / sqrtf(camera.P11 * camera.P11 + 1.0f);
+            cullView.frustum[3] = 1.0f / sqrtf(camera.P11 * camera.P11 + 1.0f);
+
+            //LOD error may project to at most one pixel : error / distance * P11 * height / 2 <= 1
+            cullView.lodTarget = 2.0f / (camera.P11 * float(extent.height));
 
-        VkClearValue clearColor[1] = { color };
+            //Both passes shade with this frame's cluster lists, tiles follow the extent
+            ClusterGrid clusterGrid = createClusterGrid(camera.P00, camera.P11, camera.znear, clusterFar, extent.width, extent.height, lighting.lightCount);
+            recordLightBinning(cmdBuffer, lighting, clusterGrid);
 
-        VkRenderPassBeginInfo rBeginInfo = {};
-        rBeginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-        rBeginInfo.renderPass = renderPass;
-        rBeginInfo.framebuffer = frameBuffers[imageIndex];
-        rBeginInfo.renderArea.extent.width = width;
-        rBeginInfo.renderArea.extent.height = height;
-        rBeginInfo.clearValueCount = sizeof(clearColor)/ sizeof(clearColor[0]);
-        rBeginInfo.pClearValues = clearColor;
+            //Early pass draws what was visible against previous depth, late pass draws what became visible against current depth
+            for (int pass = 0; pass < 2; pass++)
+            {
+                bool late = pass == 1;
+
+                if (late)
+                {
+                    recordDepthPyramid(cmdBuffer, culling, frameIndex, swapchainTargets.depth.image, extent.width, extent.height);
+                }
+
+                recordCullPass(cmdBuffer, culling, frameIndex, late, cullView);
+
+                VkRenderPassBeginInfo rBeginInfo = {};
+                rBeginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+                rBeginInfo.renderPass = late ? lateRenderPass : renderPass;
+                rBeginInfo.framebuffer = swapchainTargets.frameBuffers[imageIndex];
+                rBeginInfo.renderArea.extent = swapchainTargets.extent;
+                rBeginInfo.clearValueCount = sizeof(clearValues)/ sizeof(clearValues[0]);
+                rBeginInfo.pClearValues = clearValues;
+
+                vkCmdBeginRenderPass(cmdBuffer, &rBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+                vkCmdSetViewport(cmdBuffer, 0, 1, &viewport);
+                vkCmdSetScissor(cmdBuffer, 0, 1 ,&scissor);
+
+                vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+                vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &objectSet, 0, 0);
+                vkCmdBindIndexBuffer(cmdBuffer, indexBuffer.buffer, 0, VK_INDEX_TYPE_UINT32);
+                vkCmdPushConstants(cmdBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(camera), &camera);
 
-        vkCmdBeginRenderPass(cmdBuffer, &rBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+                recordDrawPass(cmdBuffer, culling, late);
 
-        //Vulkan flips +Y so we flip the viewport
-        VkViewport viewport = {0, static_cast<float>(height), static_cast<float>(width), -static_cast<float>(height) , 0, 1};
-        VkRect2D scissor = { {0, 0}, {width, height} };
+                //Blended over the full depth buffer once both passes have drawn
+                if (late)
+                {
+                    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, particlePipeline);
+                    vkCmdPushConstants(cmdBuffer, particleLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(camera), &camera);
 
-        vkCmdSetViewport(cmdBuffer, 0, 1, &viewport);
-        vkCmdSetScissor(cmdBuffer, 0, 1 ,&scissor);
+                    recordParticleDraw(cmdBuffer, particles, particleLayout, frameIndex);
+                }
 
-        vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
-        vkCmdDraw(cmdBuffer, 3, 1, 0, 0);
+                vkCmdEndRenderPass(cmdBuffer);
+            }
+
+            VK_CHECK(vkEndCommandBuffer(cmdBuffer));
 
-        vkCmdEndRenderPass(cmdBuffer);
+            //Present does not wait for these copies, the frame fence does and that is when the CPU reads them
+            VK_CHECK(vkBeginCommandBuffer(frame.readbackCmdBuffer, &beginInfo));
 
-        VK_CHECK(vkEndCommandBuffer(cmdBuffer));
+            endOcclusionFrame(frame.readbackCmdBuffer, culling, frameIndex);
+            recordLightReadback(frame.readbackCmdBuffer, lighting, frameIndex);
 
-        VkPipelineStageFlags stageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-        
-        VkSubmitInfo submitInfo = {};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submitInfo.waitSemaphoreCount = 1;
-        submitInfo.pWaitSemaphores = &imageAquired;
-        submitInfo.pWaitDstStageMask = &stageMask;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &cmdBuffer;
-        submitInfo.signalSemaphoreCount = 1;
-        submitInfo.pSignalSemaphores = &cmdSubmited;
+            VK_CHECK(vkEndCommandBuffer(frame.readbackCmdBuffer));
+
+            //Load time uploads ride along with the first frame, staging and their pool retire with it
+            if (uploads.cmdBuffer)
+            {
+                scheduler.addCommandBuffer(queue, SubmitUpload, uploads.cmdBuffer);
+
+                for (Buffer& staging : uploads.staging)
+                {
+                    retireBuffer(deletionQueue, frameNumber, staging);
+                }
+                deletionQueue.push(frameNumber, std::move(uploadPool));
+
+                uploads = UploadBatch();
+            }
 
-        VK_CHECK(vkQueueSubmit(queue, 1, &submitInfo, 0));
+            //No wait on the previous frame's draw, it reads its own draw data. The fence waited on above covers
+            //the last draw of the data this update writes.
+            scheduler.addCommandBuffer(computeQueue, SubmitCompute, frame.computeCmdBuffer);
+            scheduler.addSignal(computeQueue, SubmitCompute, frame.particlesReady);
+
+            scheduler.addWait(queue, SubmitGraphics, frame.imageAquired, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+            scheduler.addWait(queue, SubmitGraphics, frame.particlesReady, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT);
+            scheduler.addCommandBuffer(queue, SubmitGraphics, cmdBuffer);
+            scheduler.addSignal(queue, SubmitGraphics, frame.cmdSubmited);
+            scheduler.addCommandBuffer(queue, SubmitReadback, frame.readbackCmdBuffer);
+            scheduler.setFence(queue, frame.inFlight);
+            scheduler.flush();
+
+            VkPresentInfoKHR presentInfo = { };
+            presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+            presentInfo.waitSemaphoreCount = 1;
+            presentInfo.pWaitSemaphores = frame.cmdSubmited.address();
+            presentInfo.swapchainCount = 1;
+            presentInfo.pSwapchains = swapchainTargets.swapchain.address();
+            presentInfo.pImageIndices = &imageIndex;
+            
+            //Suboptimal still presented, both get a new swapchain before the next acquire
+            VkResult presentResult = scheduler.present(queue, presentInfo);
+
+            if (presentResult == VK_ERROR_OUT_OF_DATE_KHR || presentResult == VK_SUBOPTIMAL_KHR)
+            {
+                if (recreateSwapchainTargets(swapchainTargets, deletionQueue, frameNumber, window, device, physicalDevice, memoryProperties, surface, indices, renderPass))
+                {
+                    resizeOcclusionCulling(culling, deletionQueue, frameNumber, device, memoryProperties, swapchainTargets.depth.view,
+                                           swapchainTargets.extent.width, swapchainTargets.extent.height);
+                }
+            }
+            else
+            {
+                VK_CHECK(presentResult);
+            }
 
-        VkPresentInfoKHR presentInfo = { };
-        presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-        presentInfo.waitSemaphoreCount = 1;
-        presentInfo.pWaitSemaphores = &cmdSubmited;
-        presentInfo.swapchainCount = 1;
-        presentInfo.pSwapchains = &swapChain;
-        presentInfo.pImageIndices = &imageIndex;
-        
-        VK_CHECK(vkQueuePresentKHR(queue, &presentInfo));
+            frameNumber++;
+        }
 
+        //Only place we drain the device, everything below is destroyed by RAII in reverse order
         VK_CHECK(vkDeviceWaitIdle(device));
+        memoryTracker.clearEvictionHandlers();
+        deletionQueue.flush();
+
+        //High-water marks of the whole run
+        if (!memoryTracker.writeJson("MemoryReport.json"))
+        {
+            printf("Failed to write MemoryReport.json\n");
+        }
     }
 
+    vkDestroyDevice(device, 0);
+    vkDestroySurfaceKHR(instance, surface, 0);
+
+#ifdef _DEBUG
+    auto vkDestroyDebugUtilsMessengerEXT = (PFN_vkDestroyDebugUtilsMessengerEXT)vkGetInstanceProcAddr(instance, "vkDestroyDebugUtilsMessengerEXT");
+    assert(vkDestroyDebugUtilsMessengerEXT != nullptr);
+    vkDestroyDebugUtilsMessengerEXT(instance, callback, 0);
+#endif
+
+    vkDestroyInstance(instance, 0);
+
     glfwDestroyWindow(window);
-}
\ No newline at end of file
+    glfwTerminate();
+}
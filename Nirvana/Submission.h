@@ -0,0 +1,425 @@
+#pragma once
+
+#include <chrono>
+#include <vector>
+#include "Common.h"
+
+//Collects the command buffers every producer records for a frame and hands them to the driver in as few
+//vkQueueSubmit calls as possible. Producers only say which queue, which stage of the frame and which semaphores
+//they wait on/signal, the scheduler turns that into VkSubmitInfo batches :
+// - Stages are submitted in SubmitStage order, command buffers within a stage in the order they were added
+// - Consecutive stages on a queue share one VkSubmitInfo unless a semaphore wait or signal sits between them
+// - All VkSubmitInfo of a queue go in one vkQueueSubmit, a queue is only submitted early when another queue
+//   waits on a semaphore it signals (binary semaphore signals have to be submitted before their waits)
+//Targets Vulkan 1.1 so this is vkQueueSubmit with several VkSubmitInfo rather than vkQueueSubmit2.
+
+enum SubmitStage : uint32_t
+{
+    SubmitUpload,   //Staging copies, ordered before everything that reads them
+    SubmitCompute,  //Async compute work
+    SubmitGraphics, //Main frame
+    SubmitReadback, //Copies to host visible memory read back by the CPU
+
+    SubmitStageCount
+};
+
+//Per frame numbers, driverMs is CPU time spent inside vkQueueSubmit and vkQueuePresentKHR
+struct SubmitStats
+{
+    uint32_t submitCount = 0;
+    uint32_t batchCount = 0;
+    uint32_t commandBufferCount = 0;
+    uint32_t presentCount = 0;
+    double driverMs = 0.0;
+};
+
+class SubmissionScheduler
+{
+public:
+    //Clears work of the previous frame, keeps the allocations
+    void beginFrame()
+    {
+        items.clear();
+        fence = VK_NULL_HANDLE;
+        fenceQueue = VK_NULL_HANDLE;
+
+        lastStats = stats;
+        stats = SubmitStats();
+    }
+
+    void addCommandBuffer(VkQueue queue, SubmitStage stage, VkCommandBuffer cmdBuffer)
+    {
+        items.push_back({ queue, stage, ItemCommandBuffer, cmdBuffer, VK_NULL_HANDLE, 0 });
+    }
+
+    //Command buffers of this stage on this queue wait until stageMask
+    void addWait(VkQueue queue, SubmitStage stage, VkSemaphore semaphore, VkPipelineStageFlags stageMask)
+    {
+        items.push_back({ queue, stage, ItemWait, VK_NULL_HANDLE, semaphore, stageMask });
+    }
+
+    //Signaled once every command buffer of this stage (and earlier stages) on this queue has completed
+    void addSignal(VkQueue queue, SubmitStage stage, VkSemaphore semaphore)
+    {
+        items.push_back({ queue, stage, ItemSignal, VK_NULL_HANDLE, semaphore, 0 });
+    }
+
+    //Signaled with the last submission on queue
+    void setFence(VkQueue queue, VkFence frameFence)
+    {
+        fenceQueue = queue;
+        fence = frameFence;
+    }
+
+    void flush()
+    {
+        buildBatches();
+
+        for (const Submit& submit : submits)
+        {
+            submitInfos.clear();
+
+            for (uint32_t i = submit.firstBatch; i < submit.firstBatch + submit.batchCount; i++)
+            {
+                const Batch& batch = batches[i];
+
+                VkSubmitInfo submitInfo = {};
+                submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+                submitInfo.waitSemaphoreCount = batch.waitCount;
+                submitInfo.pWaitSemaphores = waitSemaphores.data() + batch.firstWait;
+                submitInfo.pWaitDstStageMask = waitStages.data() + batch.firstWait;
+                submitInfo.commandBufferCount = batch.cmdBufferCount;
+                submitInfo.pCommandBuffers = cmdBuffers.data() + batch.firstCmdBuffer;
+                submitInfo.signalSemaphoreCount = batch.signalCount;
+                submitInfo.pSignalSemaphores = signalSemaphores.data() + batch.firstSignal;
+
+                submitInfos.push_back(submitInfo);
+                stats.commandBufferCount += batch.cmdBufferCount;
+            }
+
+            auto begin = std::chrono::high_resolution_clock::now();
+            VK_CHECK(vkQueueSubmit(submit.queue, static_cast<uint32_t>(submitInfos.size()), submitInfos.data(), submit.fence));
+            auto end = std::chrono::high_resolution_clock::now();
+
+            stats.driverMs += std::chrono::duration<double, std::milli>(end - begin).count();
+            stats.submitCount++;
+            stats.batchCount += submit.batchCount;
+        }
+
+        items.clear();
+        fence = VK_NULL_HANDLE;
+        fenceQueue = VK_NULL_HANDLE;
+    }
+
+    //Presents are timed here so driverMs covers everything the frame hands to the driver
+    VkResult present(VkQueue queue, const VkPresentInfoKHR& presentInfo)
+    {
+        auto begin = std::chrono::high_resolution_clock::now();
+        VkResult result = vkQueuePresentKHR(queue, &presentInfo);
+        auto end = std::chrono::high_resolution_clock::now();
+
+        stats.driverMs += std::chrono::duration<double, std::milli>(end - begin).count();
+        stats.presentCount++;
+
+        return result;
+    }
+
+    //Stats of the last completed frame, current frame is still being gathered
+    const SubmitStats& getStats() const
+    {
+        return lastStats;
+    }
+
+private:
+    enum ItemType
+    {
+        ItemCommandBuffer,
+        ItemWait,
+        ItemSignal,
+    };
+
+    struct Item
+    {
+        VkQueue queue;
+        SubmitStage stage;
+        ItemType type;
+        VkCommandBuffer cmdBuffer;
+        VkSemaphore semaphore;
+        VkPipelineStageFlags stageMask;
+    };
+
+    //One VkSubmitInfo, ranges index the flat arrays below
+    struct Batch
+    {
+        uint32_t firstWait, waitCount;
+        uint32_t firstCmdBuffer, cmdBufferCount;
+        uint32_t firstSignal, signalCount;
+    };
+
+    //One vkQueueSubmit of consecutive batches
+    struct Submit
+    {
+        VkQueue queue;
+        VkFence fence;
+        uint32_t firstBatch, batchCount;
+    };
+
+    //Batches still being filled for one queue
+    struct PendingQueue
+    {
+        VkQueue queue;
+        std::vector<Batch> batches;
+        bool signaled; //Last batch has signals, the next command buffer needs a new batch
+    };
+
+    PendingQueue& getPending(VkQueue queue)
+    {
+        for (PendingQueue& pending : pendingQueues)
+        {
+            if (pending.queue == queue)
+            {
+                return pending;
+            }
+        }
+
+        pendingQueues.push_back({ queue, {}, false });
+        return pendingQueues.back();
+    }
+
+    //Moves the batches of a queue to the submit list, the flat arrays are final at this point for them
+    void closeQueue(PendingQueue& pending)
+    {
+        if (pending.batches.empty())
+        {
+            return;
+        }
+
+        Submit submit = { pending.queue, VK_NULL_HANDLE, static_cast<uint32_t>(batches.size()), static_cast<uint32_t>(pending.batches.size()) };
+        batches.insert(batches.end(), pending.batches.begin(), pending.batches.end());
+        submits.push_back(submit);
+
+        pending.batches.clear();
+        pending.signaled = false;
+    }
+
+    PendingQueue* findSignalingQueue(VkQueue waitingQueue, VkSemaphore semaphore)
+    {
+        for (PendingQueue& pending : pendingQueues)
+        {
+            if (pending.queue == waitingQueue)
+            {
+                continue;
+            }
+
+            for (const Batch& batch : pending.batches)
+            {
+                for (uint32_t i = batch.firstSignal; i < batch.firstSignal + batch.signalCount; i++)
+                {
+                    if (signalSemaphores[i] == semaphore)
+                    {
+                        return &pending;
+                    }
+                }
+            }
+        }
+
+        return nullptr;
+    }
+
+    //Another queue has a pending batch signaling semaphore, it has to reach the driver before the wait does
+    void closeSignalingQueue(VkQueue waitingQueue, VkSemaphore semaphore)
+    {
+        if (PendingQueue* pending = findSignalingQueue(waitingQueue, semaphore))
+        {
+            closeQueue(*pending);
+        }
+    }
+
+    bool waitsOnPendingQueue(const PendingQueue& pending)
+    {
+        for (const Batch& batch : pending.batches)
+        {
+            for (uint32_t i = batch.firstWait; i < batch.firstWait + batch.waitCount; i++)
+            {
+                if (findSignalingQueue(pending.queue, waitSemaphores[i]))
+                {
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    //Queues waiting on a signal of the same stage go after the queue that signals it
+    void closeAllQueues()
+    {
+        for (bool closed = true; closed;)
+        {
+            closed = false;
+
+            for (PendingQueue& pending : pendingQueues)
+            {
+                if (!pending.batches.empty() && !waitsOnPendingQueue(pending))
+                {
+                    closeQueue(pending);
+                    closed = true;
+                }
+            }
+        }
+
+        for (const PendingQueue& pending : pendingQueues)
+        {
+            assert(pending.batches.empty() && "Queues wait on each other's semaphores");
+        }
+    }
+
+    void buildBatches()
+    {
+        waitSemaphores.clear();
+        waitStages.clear();
+        cmdBuffers.clear();
+        signalSemaphores.clear();
+        batches.clear();
+        submits.clear();
+        pendingQueues.clear();
+
+        //Each stage of each queue appends its waits, command buffers and signals in one go so batch ranges stay contiguous
+        for (uint32_t stage = 0; stage < SubmitStageCount; stage++)
+        {
+            for (size_t first = 0; first < items.size(); first++)
+            {
+                const Item& item = items[first];
+
+                if (item.stage != stage || isQueueSeen(item.queue, stage, first))
+                {
+                    continue;
+                }
+
+                appendStage(item.queue, static_cast<SubmitStage>(stage));
+            }
+        }
+
+        closeAllQueues();
+
+        //Fence goes on the last submit of its queue, or an empty submit when that queue got no work
+        if (fence)
+        {
+            Submit* last = nullptr;
+            for (Submit& submit : submits)
+            {
+                if (submit.queue == fenceQueue)
+                {
+                    last = &submit;
+                }
+            }
+
+            if (last)
+            {
+                last->fence = fence;
+            }
+            else
+            {
+                submits.push_back({ fenceQueue, fence, static_cast<uint32_t>(batches.size()), 0 });
+            }
+        }
+    }
+
+    //Whether an earlier item of the same stage already brought this queue's stage in
+    bool isQueueSeen(VkQueue queue, uint32_t stage, size_t index) const
+    {
+        for (size_t i = 0; i < index; i++)
+        {
+            if (items[i].stage == stage && items[i].queue == queue)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void appendStage(VkQueue queue, SubmitStage stage)
+    {
+        uint32_t waitCount = 0;
+        uint32_t cmdBufferCount = 0;
+        uint32_t signalCount = 0;
+
+        for (const Item& item : items)
+        {
+            if (item.queue == queue && item.stage == stage && item.type == ItemWait)
+            {
+                closeSignalingQueue(queue, item.semaphore);
+                waitCount++;
+            }
+        }
+
+        PendingQueue& pending = getPending(queue);
+
+        //Waits only delay the stages in their mask but would still hold back earlier command buffers, so they start a batch.
+        //A batch can only grow while no other queue appended to the arrays after it.
+        bool contiguous = !pending.batches.empty() &&
+                          pending.batches.back().firstCmdBuffer + pending.batches.back().cmdBufferCount == cmdBuffers.size() &&
+                          pending.batches.back().firstSignal + pending.batches.back().signalCount == signalSemaphores.size();
+
+        if (!contiguous || pending.signaled || waitCount > 0)
+        {
+            Batch batch = {};
+            batch.firstWait = static_cast<uint32_t>(waitSemaphores.size());
+            batch.firstCmdBuffer = static_cast<uint32_t>(cmdBuffers.size());
+            batch.firstSignal = static_cast<uint32_t>(signalSemaphores.size());
+            pending.batches.push_back(batch);
+            pending.signaled = false;
+        }
+
+        Batch& batch = pending.batches.back();
+
+        for (const Item& item : items)
+        {
+            if (item.queue == queue && item.stage == stage && item.type == ItemWait)
+            {
+                waitSemaphores.push_back(item.semaphore);
+                waitStages.push_back(item.stageMask);
+            }
+        }
+
+        for (const Item& item : items)
+        {
+            if (item.queue == queue && item.stage == stage && item.type == ItemCommandBuffer)
+            {
+                cmdBuffers.push_back(item.cmdBuffer);
+                cmdBufferCount++;
+            }
+        }
+
+        for (const Item& item : items)
+        {
+            if (item.queue == queue && item.stage == stage && item.type == ItemSignal)
+            {
+                signalSemaphores.push_back(item.semaphore);
+                signalCount++;
+            }
+        }
+
+        batch.waitCount += waitCount;
+        batch.cmdBufferCount += cmdBufferCount;
+        batch.signalCount += signalCount;
+        pending.signaled = signalCount > 0;
+    }
+
+    std::vector<Item> items;
+    VkFence fence = VK_NULL_HANDLE;
+    VkQueue fenceQueue = VK_NULL_HANDLE;
+
+    std::vector<VkSemaphore> waitSemaphores;
+    std::vector<VkPipelineStageFlags> waitStages;
+    std::vector<VkCommandBuffer> cmdBuffers;
+    std::vector<VkSemaphore> signalSemaphores;
+    std::vector<Batch> batches;
+    std::vector<Submit> submits;
+    std::vector<PendingQueue> pendingQueues;
+    std::vector<VkSubmitInfo> submitInfos;
+
+    SubmitStats stats;
+    SubmitStats lastStats;
+};